@@ -2,9 +2,9 @@
 namespace evproto
 {
 
-inline void send(struct bufferevent* bev, const RpcMessage& message)
+// Appends the frame of message to buf.
+inline void encode(struct evbuffer* buf, const RpcMessage& message)
 {
-  struct evbuffer* buf = evbuffer_new();
   const int byte_size = message.ByteSize();
   const int len = byte_size + 8; // RPC0 + adler32
   const int total_len = len + 4; // length prepend
@@ -34,6 +34,98 @@ inline void send(struct bufferevent* bev, const RpcMessage& message)
   assert(start - static_cast<uint8_t*>(vec.iov_base) == total_len);
   vec.iov_len = total_len;
   evbuffer_commit_space(buf, &vec, 1);
+}
+
+inline void send(struct bufferevent* bev, const RpcMessage& message)
+{
+  struct evbuffer* buf = evbuffer_new();
+  encode(buf, message);
+  bufferevent_write_buffer(bev, buf);
+  evbuffer_free(buf);
+}
+
+inline void appendVarint(std::string* buf, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    buf->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  buf->push_back(static_cast<char>(value));
+}
+
+// tag and length of a bytes field, its data follows
+inline void appendBytesFieldHeader(std::string* buf, int field, size_t len)
+{
+  appendVarint(buf, (static_cast<uint32_t>(field) << 3) | 2); // length-delimited
+  appendVarint(buf, len);
+}
+
+// Appends the same frame as encode() would for message with its response
+// set to the serialized response plus bytes field 'field' holding data.
+// data is appended by reference, the socket gets it without any copying,
+// cleanup is called by libevent once it is written or dropped.
+// A field may appear after the other fields on the wire, so the receiver
+// needs nothing special.
+inline void encodeWithAttachment(struct evbuffer* buf,
+                                 const RpcMessage& message,
+                                 const gpb::Message& response,
+                                 int field,
+                                 const void* data,
+                                 size_t len,
+                                 evbuffer_ref_cleanup_cb cleanup,
+                                 void* arg)
+{
+  assert(!message.has_response());
+  std::string responseHead;
+  // the attached field may be a required one
+  response.AppendPartialToString(&responseHead);
+  appendBytesFieldHeader(&responseHead, field, len);
+
+  std::string head("RPC0");
+  message.AppendToString(&head);
+  appendBytesFieldHeader(&head, RpcMessage::kResponseFieldNumber, responseHead.size() + len);
+  head += responseHead;
+
+  uLong checkSum = ::adler32(1, reinterpret_cast<const Bytef*>(head.data()), head.size());
+  checkSum = ::adler32(checkSum, static_cast<const Bytef*>(data), len);
+
+  int len_be = htonl(static_cast<int>(head.size() + len + 4));
+  evbuffer_add(buf, &len_be, sizeof len_be);
+  evbuffer_add(buf, head.data(), head.size());
+  evbuffer_add_reference(buf, data, len, cleanup, arg);
+  int32_t checkSum_be = htonl(static_cast<int32_t>(checkSum));
+  evbuffer_add(buf, &checkSum_be, sizeof checkSum_be);
+}
+
+// A frame larger than a slice is cut into fragment frames: "RPCF" for all
+// but the last, "RPCE" for the last, each carrying the next bytes of the
+// whole frame, length and checksum included. Frames of other messages may
+// go between them, fragments of different frames never interleave.
+//
+// Moves the next n bytes of the frame at the front of frames to bev.
+inline void sendFragment(struct bufferevent* bev, struct evbuffer* frames, size_t n, bool last)
+{
+  const char* magic = last ? "RPCE" : "RPCF";
+  uLong checkSum = ::adler32(1, reinterpret_cast<const Bytef*>(magic), 4);
+  const int nvec = evbuffer_peek(frames, n, NULL, NULL, 0);
+  std::vector<struct evbuffer_iovec> vec(nvec);
+  evbuffer_peek(frames, n, NULL, &vec[0], nvec);
+  size_t left = n;
+  for (int i = 0; i < nvec && left > 0; ++i)
+  {
+    size_t len = std::min(left, vec[i].iov_len);
+    checkSum = ::adler32(checkSum, static_cast<const Bytef*>(vec[i].iov_base), len);
+    left -= len;
+  }
+
+  struct evbuffer* buf = evbuffer_new();
+  int len_be = htonl(static_cast<int>(n + 8));
+  evbuffer_add(buf, &len_be, sizeof len_be);
+  evbuffer_add(buf, magic, 4);
+  evbuffer_remove_buffer(frames, buf, n);
+  int32_t checkSum_be = htonl(static_cast<int32_t>(checkSum));
+  evbuffer_add(buf, &checkSum_be, sizeof checkSum_be);
   bufferevent_write_buffer(bev, buf);
   evbuffer_free(buf);
 }
@@ -90,7 +182,64 @@ inline ParseErrorCode parse(const char* buf, int len, RpcMessage* message)
   return error;
 }
 
-inline ParseErrorCode read(struct evbuffer* input, RpcChannel* channel)
+inline bool isFragment(const char* buf)
+{
+  return memcmp(buf, "RPCF", 4) == 0 || memcmp(buf, "RPCE", 4) == 0;
+}
+
+// Appends the bytes of a fragment to frame. After the last one, parses the
+// whole frame into message and sets complete.
+inline ParseErrorCode parseFragment(const char* buf, int len, std::string* frame,
+                                    RpcMessage* message, bool* complete)
+{
+  *complete = false;
+  int32_t be32 = 0;
+  memcpy(&be32, buf + len - 4, sizeof be32);
+  int32_t expectedCheckSum = ntohl(be32);
+  int32_t checkSum = static_cast<int32_t>(
+      ::adler32(1, reinterpret_cast<const Bytef*>(buf), len - 4));
+  if (checkSum != expectedCheckSum)
+  {
+    return kCheckSumError;
+  }
+  if (frame->size() + len - 8 > 64*1024*1024 + 4)
+  {
+    return kInvalidLength;
+  }
+  frame->append(buf + 4, len - 8);
+  if (memcmp(buf, "RPCE", 4) != 0)
+  {
+    return kNoError;
+  }
+
+  *complete = true;
+  std::string whole;
+  whole.swap(*frame);
+  int32_t wholeLen = 0;
+  if (whole.size() >= 12)
+  {
+    memcpy(&be32, whole.data(), sizeof be32);
+    wholeLen = ntohl(be32);
+  }
+  if (wholeLen < 8 || static_cast<size_t>(wholeLen) + 4 != whole.size())
+  {
+    return kInvalidLength;
+  }
+  return parse(whole.data() + 4, wholeLen, message);
+}
+
+struct ReadBudget
+{
+  int maxFrames;      // 0 for no limit
+  int64_t deadline;   // monotonicNanos(), 0 for none
+  int frames;         // dispatched
+  bool exhausted;     // stopped by the budget with a complete frame left
+};
+
+// Dispatches the complete frames in input, at least one and then within
+// budget if given.
+inline ParseErrorCode read(struct evbuffer* input, RpcChannel* channel,
+                           ReadBudget* budget = NULL)
 {
   ParseErrorCode error = kNoError;
   int readable = evbuffer_get_length(input);
@@ -106,15 +255,41 @@ inline ParseErrorCode read(struct evbuffer* input, RpcChannel* channel)
     }
     else if (readable >= len + 4)
     {
+      if (budget && budget->frames > 0
+          && ((budget->maxFrames > 0 && budget->frames >= budget->maxFrames)
+              || (budget->deadline > 0 && monotonicNanos() >= budget->deadline)))
+      {
+        budget->exhausted = true;
+        break;
+      }
       RpcMessage message;
       const char* data = reinterpret_cast<char*>(evbuffer_pullup(input, len + 4));
-      error = parse(data + 4, len, &message);
+      bool complete = true;
+      if (isFragment(data + 4))
+      {
+        error = parseFragment(data + 4, len, channel->fragments(), &message, &complete);
+      }
+      else
+      {
+        error = parse(data + 4, len, &message);
+      }
       if (error == kNoError)
       {
-        channel->onMessage(message);
+        if (complete)
+        {
+          channel->onMessage(message);
+        }
+        if (budget)
+        {
+          ++budget->frames;
+        }
         evbuffer_drain(input, len + 4);
         readable = evbuffer_get_length(input);
       }
+      else
+      {
+        break;
+      }
     }
     else
     {
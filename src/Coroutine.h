@@ -0,0 +1,257 @@
+// Copyright 2010, Shuo Chen.  All rights reserved.
+// http://code.google.com/p/evproto2
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+// Author: Shuo Chen (chenshuo at chenshuo dot com)
+//
+
+#ifndef EVPROTO2_COROUTINE_H
+#define EVPROTO2_COROUTINE_H
+
+// Awaitable and future-based calls over any generated Stub.
+//
+//   evproto::Task getName(kvdb::LeveldbService::Stub* stub)
+//   {
+//     kvdb::GetRequest request;
+//     request.set_key("name");
+//     auto get = evproto::call(stub, &kvdb::LeveldbService::Stub::Get, request);
+//     kvdb::GetResponse response = co_await get;
+//     if (get.Failed())
+//     {
+//       printf("%s\n", get.ErrorText().c_str());
+//     }
+//   }
+//
+// A call fails, and resumes with an empty response, when the channel
+// does, eg. the connection closes with the call in flight.
+// A coroutine is resumed in the thread that runs the done closure,
+// that is the loop thread of the RpcChannel behind the stub.
+// Only the rest of the library stays C++03, this header needs -std=c++20.
+
+#if !defined(__cpp_impl_coroutine)
+#error "Coroutine.h requires C++20 coroutines, compile with -std=c++20"
+#endif
+
+#include "RpcController.h"
+
+#include <google/protobuf/service.h>
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace evproto
+{
+
+namespace gpb = ::google::protobuf;
+
+// Fire-and-forget coroutine, runs eagerly and frees its frame when it returns.
+struct Task
+{
+  struct promise_type
+  {
+    Task get_return_object() { return Task(); }
+    std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+    std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+// One outstanding RPC, co_await it to get the response, then see Failed().
+// The request is copied, so temporaries are fine.
+template<typename CLASS, typename REQUEST, typename RESPONSE>
+class Call
+{
+ public:
+  typedef RESPONSE Response;
+  typedef void (CLASS::*Method)(gpb::RpcController*,
+                                const REQUEST*,
+                                RESPONSE*,
+                                gpb::Closure*);
+
+  Call(CLASS* stub, Method method, const REQUEST& request)
+    : stub_(stub),
+      method_(method),
+      request_(request),
+      pending_(NULL)
+  {
+  }
+
+  // for std::vector, only valid before the call is started. Carries over
+  // what was set on controller(), its priority.
+  Call(const Call& rhs)
+    : stub_(rhs.stub_),
+      method_(rhs.method_),
+      request_(rhs.request_),
+      pending_(NULL)
+  {
+    if (rhs.controller_.hasPriority())
+    {
+      controller_.setPriority(rhs.controller_.priority());
+    }
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> handle)
+  {
+    // one count for the response, one for us, so that a response
+    // arriving before we return does not resume the coroutine twice.
+    count_.store(2);
+    start(handle, &count_);
+    return count_.fetch_sub(1) != 1;
+  }
+
+  RESPONSE await_resume() { return std::move(response_); }
+
+  // Set its priority before the call is started, see if it failed after.
+  RpcController* controller() { return &controller_; }
+  bool Failed() const { return controller_.Failed(); }
+  std::string ErrorText() const { return controller_.ErrorText(); }
+
+  // issue the call, resume handle when *pending drops to zero.
+  void start(std::coroutine_handle<> handle, std::atomic<int>* pending)
+  {
+    handle_ = handle;
+    pending_ = pending;
+    // deleted by RpcChannel after done->Run()
+    RESPONSE* response = new RESPONSE;
+    (stub_->*method_)(&controller_, &request_, response,
+                      gpb::NewCallback(this, &Call::onDone, response));
+    // may have been resumed and destroyed already, don't touch this.
+  }
+
+  RESPONSE& response() { return response_; }
+
+ private:
+  void onDone(RESPONSE* response)
+  {
+    response_.Swap(response);
+    if (pending_->fetch_sub(1) == 1)
+    {
+      handle_.resume();
+    }
+  }
+
+  CLASS* stub_;
+  Method method_;
+  REQUEST request_;
+  RESPONSE response_;
+  RpcController controller_;
+  std::coroutine_handle<> handle_;
+  std::atomic<int>* pending_;
+  std::atomic<int> count_;
+};
+
+template<typename STUB, typename CLASS, typename REQUEST, typename RESPONSE>
+Call<CLASS, REQUEST, RESPONSE>
+call(STUB* stub,
+     void (CLASS::*method)(gpb::RpcController*, const REQUEST*, RESPONSE*, gpb::Closure*),
+     const REQUEST& request)
+{
+  return Call<CLASS, REQUEST, RESPONSE>(stub, method, request);
+}
+
+// Issues all calls at once, resumes when the last response arrives, or
+// the last call fails. Responses come back in the order of the calls, see
+// Failed() of each call for which ones are real.
+template<typename CALL>
+class WhenAll
+{
+ public:
+  typedef typename CALL::Response Response;
+
+  explicit WhenAll(std::vector<CALL>* calls)
+    : calls_(calls)
+  {
+  }
+
+  bool await_ready() const noexcept { return calls_->empty(); }
+
+  bool await_suspend(std::coroutine_handle<> handle)
+  {
+    const size_t n = calls_->size();
+    CALL* calls = &(*calls_)[0];
+    pending_.store(static_cast<int>(n) + 1);
+    for (size_t i = 0; i < n; ++i)
+    {
+      calls[i].start(handle, &pending_);
+    }
+    return pending_.fetch_sub(1) != 1;
+  }
+
+  std::vector<Response> await_resume()
+  {
+    std::vector<Response> responses(calls_->size());
+    for (size_t i = 0; i < calls_->size(); ++i)
+    {
+      responses[i].Swap(&(*calls_)[i].response());
+    }
+    return responses;
+  }
+
+ private:
+  std::vector<CALL>* calls_;
+  std::atomic<int> pending_;
+};
+
+// The vector must not be touched until the co_await completes.
+template<typename CALL>
+WhenAll<CALL> whenAll(std::vector<CALL>* calls)
+{
+  return WhenAll<CALL>(calls);
+}
+
+namespace detail
+{
+template<typename RESPONSE>
+struct FutureCall
+{
+  std::promise<RESPONSE> promise;
+  RpcController controller;
+};
+
+template<typename RESPONSE>
+void fulfil(FutureCall<RESPONSE>* call, RESPONSE* response)
+{
+  if (call->controller.Failed())
+  {
+    call->promise.set_exception(
+        std::make_exception_ptr(std::runtime_error(call->controller.ErrorText())));
+  }
+  else
+  {
+    call->promise.set_value(std::move(*response));
+  }
+  delete call;
+}
+}
+
+// Future variant, for callers outside of a coroutine. A failed call throws
+// std::runtime_error with its ErrorText() from get().
+// Never wait on it in the loop thread of the channel, it would deadlock.
+template<typename STUB, typename CLASS, typename REQUEST, typename RESPONSE>
+std::future<RESPONSE>
+callFuture(STUB* stub,
+           void (CLASS::*method)(gpb::RpcController*, const REQUEST*, RESPONSE*, gpb::Closure*),
+           const REQUEST& request)
+{
+  detail::FutureCall<RESPONSE>* call = new detail::FutureCall<RESPONSE>;
+  std::future<RESPONSE> future = call->promise.get_future();
+  RESPONSE* response = new RESPONSE;
+  (static_cast<CLASS*>(stub)->*method)(&call->controller, &request, response,
+      gpb::NewCallback(&detail::fulfil<RESPONSE>, call, response));
+  return future;
+}
+
+}
+
+#endif  // EVPROTO2_COROUTINE_H
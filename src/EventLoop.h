@@ -12,6 +12,8 @@
 
 #include <event2/event.h>
 
+#include <assert.h>
+
 namespace evproto
 {
 
@@ -0,0 +1,142 @@
+#include "ResponseCache.h"
+#include "RpcChannel.h"
+
+#include <zlib.h>
+
+#include <assert.h>
+
+using namespace evproto;
+
+ResponseCache::ResponseCache(size_t capacity)
+  : capacity_(capacity),
+    shardCapacity_(capacity / kShards)
+{
+  for (int i = 0; i < kShards; ++i)
+  {
+    shards_.push_back(new Shard);
+  }
+}
+
+ResponseCache::~ResponseCache()
+{
+  for (size_t i = 0; i < shards_.size(); ++i)
+  {
+    delete shards_[i];
+  }
+}
+
+void ResponseCache::setTtl(const gpb::MethodDescriptor* method, int millis)
+{
+  if (millis > 0)
+  {
+    ttls_[method] = millis;
+  }
+  else
+  {
+    ttls_.erase(method);
+  }
+}
+
+int ResponseCache::ttlOf(const gpb::MethodDescriptor* method) const
+{
+  std::map<const gpb::MethodDescriptor*, int>::const_iterator it = ttls_.find(method);
+  return it != ttls_.end() ? it->second : 0;
+}
+
+uint32_t ResponseCache::hashOf(const gpb::MethodDescriptor* method, const std::string& request)
+{
+  uLong crc = ::crc32(0, reinterpret_cast<const Bytef*>(&method), sizeof method);
+  crc = ::crc32(crc, reinterpret_cast<const Bytef*>(request.data()), request.size());
+  return static_cast<uint32_t>(crc);
+}
+
+// the hash only picks candidates, the request bytes decide
+ResponseCache::Index::iterator ResponseCache::find(Shard& shard, uint32_t hash,
+                                                   const gpb::MethodDescriptor* method,
+                                                   const std::string& request)
+{
+  std::pair<Index::iterator, Index::iterator> range = shard.index.equal_range(hash);
+  for (Index::iterator it = range.first; it != range.second; ++it)
+  {
+    const Entry& e = *it->second;
+    if (e.method == method && e.request == request)
+    {
+      return it;
+    }
+  }
+  return shard.index.end();
+}
+
+bool ResponseCache::lookup(const gpb::MethodDescriptor* method, const std::string& request,
+                           std::string* response)
+{
+  const uint32_t hash = hashOf(method, request);
+  Shard& shard = *shards_[hash % shards_.size()];
+  muduo::MutexLockGuard lock(shard.mutex);
+  Index::iterator it = find(shard, hash, method, request);
+  if (it != shard.index.end())
+  {
+    if (it->second->expires > monotonicNanos())
+    {
+      shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+      *response = it->second->response;
+      hits_.increment();
+      return true;
+    }
+    remove(shard, it);
+  }
+  misses_.increment();
+  return false;
+}
+
+void ResponseCache::insert(const gpb::MethodDescriptor* method, const std::string& request,
+                           const std::string& response)
+{
+  const int ttl = ttlOf(method);
+  const size_t size = charge(request, response);
+  if (ttl <= 0 || size > shardCapacity_)
+  {
+    return;
+  }
+
+  const uint32_t hash = hashOf(method, request);
+  Shard& shard = *shards_[hash % shards_.size()];
+  muduo::MutexLockGuard lock(shard.mutex);
+  Index::iterator found = find(shard, hash, method, request);
+  if (found != shard.index.end())
+  {
+    remove(shard, found);
+  }
+
+  while (shard.usage + size > shardCapacity_)
+  {
+    assert(!shard.lru.empty());
+    EntryList::iterator last = --shard.lru.end();
+    Index::iterator it = shard.index.lower_bound(last->hash);
+    while (it->second != last)
+    {
+      ++it;
+    }
+    remove(shard, it);
+    evictions_.increment();
+  }
+
+  Entry e = { method, hash, request, response,
+              monotonicNanos() + static_cast<int64_t>(ttl) * 1000000 };
+  shard.lru.push_front(e);
+  shard.index.insert(std::make_pair(hash, shard.lru.begin()));
+  shard.usage += size;
+  bytes_.add(size);
+  entries_.increment();
+}
+
+void ResponseCache::remove(Shard& shard, Index::iterator it)
+{
+  EntryList::iterator entry = it->second;
+  const size_t size = charge(entry->request, entry->response);
+  shard.index.erase(it);
+  shard.lru.erase(entry);
+  shard.usage -= size;
+  bytes_.add(-static_cast<int64_t>(size));
+  entries_.decrement();
+}
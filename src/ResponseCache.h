@@ -0,0 +1,109 @@
+// Copyright 2010, Shuo Chen.  All rights reserved.
+// http://code.google.com/p/evproto2
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+// Author: Shuo Chen (chenshuo at chenshuo dot com)
+//
+
+#ifndef EVPROTO2_RESPONSECACHE_H
+#define EVPROTO2_RESPONSECACHE_H
+
+#include <google/protobuf/descriptor.h>
+
+#include "muduo/Atomic.h"
+#include "muduo/Mutex.h"
+
+#include <stdint.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace evproto
+{
+
+namespace gpb = ::google::protobuf;
+
+// Serialized responses of idempotent methods, keyed by the method and the
+// serialized request, for a per-method time to live. Sharded by request
+// hash, each shard is an LRU list bounded by capacity/kShards bytes.
+// Shared by the channels of an RpcServer.
+class ResponseCache // : boost::noncopyable
+{
+ public:
+  explicit ResponseCache(size_t capacity);
+  ~ResponseCache();
+
+  // Not thread safe, call before serving. 0 stops caching method.
+  void setTtl(const gpb::MethodDescriptor* method, int millis);
+  // 0 if method is not cached.
+  int ttlOf(const gpb::MethodDescriptor* method) const;
+
+  bool lookup(const gpb::MethodDescriptor* method, const std::string& request,
+              std::string* response);
+  void insert(const gpb::MethodDescriptor* method, const std::string& request,
+              const std::string& response);
+
+  size_t capacity() const { return capacity_; }
+  int64_t hits() const { return hits_.get(); }
+  int64_t misses() const { return misses_.get(); }
+  int64_t evictions() const { return evictions_.get(); }
+  int64_t bytes() const { return bytes_.get(); }
+  int64_t entries() const { return entries_.get(); }
+
+ private:
+  static const int kShards = 16;
+
+  struct Entry
+  {
+    const gpb::MethodDescriptor* method;
+    uint32_t hash;
+    std::string request;
+    std::string response;
+    int64_t expires;  // monotonicNanos()
+  };
+  typedef std::list<Entry> EntryList;
+  typedef std::multimap<uint32_t, EntryList::iterator> Index;
+
+  struct Shard
+  {
+    Shard() : mutex("ResponseCache::Shard::mutex"), usage(0) {}
+
+    muduo::MutexLock mutex;
+    EntryList lru;  // most recently used at front
+    Index index;
+    size_t usage;
+  };
+
+  static uint32_t hashOf(const gpb::MethodDescriptor* method, const std::string& request);
+  static size_t charge(const std::string& request, const std::string& response)
+  {
+    // node, map entry and string headers, roughly
+    return request.size() + response.size() + 160;
+  }
+
+  Index::iterator find(Shard& shard, uint32_t hash,
+                       const gpb::MethodDescriptor* method, const std::string& request);
+  void remove(Shard& shard, Index::iterator it);
+
+  const size_t capacity_;
+  const size_t shardCapacity_;
+  std::vector<Shard*> shards_;
+  std::map<const gpb::MethodDescriptor*, int> ttls_;
+
+  muduo::AtomicInt64 hits_;
+  muduo::AtomicInt64 misses_;
+  muduo::AtomicInt64 evictions_;
+  muduo::AtomicInt64 bytes_;
+  muduo::AtomicInt64 entries_;
+
+  void operator=(const ResponseCache&);
+  ResponseCache(const ResponseCache&);
+};
+
+}
+
+#endif  // EVPROTO2_RESPONSECACHE_H
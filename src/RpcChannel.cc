@@ -1,9 +1,15 @@
 #include "RpcChannel.h"
+#include "RpcController.h"
+#include "ResponseCache.h"
+#include "ShmPipe.h"
 #include "EventLoop.h"
 #include "rpc.pb.h"
 #include <event2/buffer.h>
 #include <zlib.h>
 
+#include <algorithm>
+#include <vector>
+
 #include <event2/thread.h>
 
 #if !defined(LIBEVENT_VERSION_NUMBER) || LIBEVENT_VERSION_NUMBER < 0x02000a00
@@ -35,22 +41,99 @@ static InitObj initObj;
 using namespace evproto;
 using std::string;
 
+namespace
+{
+
+// only the loop thread writes it
+void setMax(muduo::AtomicInt64* max, int64_t value)
+{
+  if (value > max->get())
+  {
+    max->getAndSet(value);
+  }
+}
+
+}
+
 RpcChannel::RpcChannel(EventLoop* loop, const string& host, int port)
-  : evConn_(bufferevent_socket_new(loop->eventBase(), -1, BEV_OPT_CLOSE_ON_FREE)),
+  : shm_(!host.empty() && host[0] == '/' ? new ShmPipe(loop->eventBase(), host) : NULL),
+    evConn_(shm_ ? shm_->bufferevent()
+            : bufferevent_socket_new(loop->eventBase(), -1, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE)),
     connectFailed_(false),
     disconnect_cb_(NULL),
-    ptr_(NULL)
+    ptr_(NULL),
+    bufferedBytes_(NULL),
+    lastActive_(monotonicSeconds()),
+    mutex_("RpcChannel::mutex_"),
+    pendingRequests_(0),
+    closing_(false),
+    sliceBytes_(0),
+    sliced_(evbuffer_new()),
+    slicedLeft_(0),
+    readPaused_(false),
+    budgetFrames_(0),
+    budgetNanos_(0),
+    resume_(NULL),
+    yieldedAt_(0),
+    readStats_(NULL),
+    responseCache_(NULL)
 {
   bufferevent_setcb(evConn_, readCallback, NULL, eventCallback, this);
-  bufferevent_socket_connect_hostname(evConn_, NULL, AF_INET, host.c_str(), port);
+  if (shm_ == NULL)
+  {
+    bufferevent_socket_connect_hostname(evConn_, NULL, AF_INET, host.c_str(), port);
+  }
 }
 
 RpcChannel::RpcChannel(struct event_base* base, int fd, const std::map<std::string, gpb::Service*>& services)
-  : evConn_(bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE)),
+  : shm_(NULL),
+    evConn_(bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE)),
     connectFailed_(false),
     disconnect_cb_(NULL),
     ptr_(NULL),
-    services_(services)
+    bufferedBytes_(NULL),
+    lastActive_(monotonicSeconds()),
+    mutex_("RpcChannel::mutex_"),
+    pendingRequests_(0),
+    closing_(false),
+    services_(services),
+    sliceBytes_(0),
+    sliced_(evbuffer_new()),
+    slicedLeft_(0),
+    readPaused_(false),
+    budgetFrames_(0),
+    budgetNanos_(0),
+    resume_(NULL),
+    yieldedAt_(0),
+    readStats_(NULL),
+    responseCache_(NULL)
+{
+  bufferevent_setcb(evConn_, readCallback, NULL, eventCallback, this);
+  bufferevent_enable(evConn_, EV_READ|EV_WRITE);
+}
+
+RpcChannel::RpcChannel(ShmPipe* pipe, const std::map<std::string, gpb::Service*>& services)
+  : shm_(pipe),
+    evConn_(pipe->bufferevent()),
+    connectFailed_(false),
+    disconnect_cb_(NULL),
+    ptr_(NULL),
+    bufferedBytes_(NULL),
+    lastActive_(monotonicSeconds()),
+    mutex_("RpcChannel::mutex_"),
+    pendingRequests_(0),
+    closing_(false),
+    services_(services),
+    sliceBytes_(0),
+    sliced_(evbuffer_new()),
+    slicedLeft_(0),
+    readPaused_(false),
+    budgetFrames_(0),
+    budgetNanos_(0),
+    resume_(NULL),
+    yieldedAt_(0),
+    readStats_(NULL),
+    responseCache_(NULL)
 {
   bufferevent_setcb(evConn_, readCallback, NULL, eventCallback, this);
   bufferevent_enable(evConn_, EV_READ|EV_WRITE);
@@ -58,7 +141,24 @@ RpcChannel::RpcChannel(struct event_base* base, int fd, const std::map<std::stri
 
 RpcChannel::~RpcChannel()
 {
+  if (bufferedBytes_)
+  {
+    struct evbuffer* input = bufferevent_get_input(evConn_);
+    struct evbuffer* output = bufferevent_get_output(evConn_);
+    evbuffer_remove_cb(input, bufferCallback, this);
+    evbuffer_remove_cb(output, bufferCallback, this);
+    evbuffer_remove_cb(sliced_, bufferCallback, this);
+    bufferedBytes_->add(-static_cast<int64_t>(evbuffer_get_length(input)
+                                              + evbuffer_get_length(output)
+                                              + evbuffer_get_length(sliced_)));
+  }
+  if (resume_)
+  {
+    event_free(resume_);
+  }
   bufferevent_free(evConn_);
+  delete shm_;
+  evbuffer_free(sliced_);
   // printf("~RpcChannel()\n");
 }
 
@@ -68,6 +168,121 @@ void RpcChannel::setDisconnectCb(disconnect_cb cb, void* ptr)
   ptr_ = ptr;
 }
 
+void RpcChannel::close()
+{
+  // no more callbacks, but keep evConn_ for done callbacks in flight.
+  bufferevent_setcb(evConn_, NULL, NULL, NULL, NULL);
+  bufferevent_disable(evConn_, EV_READ|EV_WRITE);
+  if (resume_)
+  {
+    event_del(resume_);
+  }
+
+  bool idle = false;
+  {
+  muduo::MutexLockGuard lock(mutex_);
+  closing_ = true;
+  idle = pendingRequests_ == 0;
+  }
+  if (idle)
+  {
+    delete this;
+  }
+}
+
+void RpcChannel::setBufferedBytesCounter(muduo::AtomicInt64* counter)
+{
+  assert(bufferedBytes_ == NULL);
+  bufferedBytes_ = counter;
+  struct evbuffer* input = bufferevent_get_input(evConn_);
+  struct evbuffer* output = bufferevent_get_output(evConn_);
+  // evbuffer callbacks run with the buffer locked, add before the first one
+  bufferevent_lock(evConn_);
+  bufferedBytes_->add(evbuffer_get_length(input) + evbuffer_get_length(output)
+                      + evbuffer_get_length(sliced_));
+  evbuffer_add_cb(input, bufferCallback, this);
+  evbuffer_add_cb(output, bufferCallback, this);
+  evbuffer_add_cb(sliced_, bufferCallback, this);
+  bufferevent_unlock(evConn_);
+}
+
+void RpcChannel::setSliceBytes(size_t bytes)
+{
+  bufferevent_lock(evConn_);
+  sliceBytes_ = bytes;
+  // refill the output from the low lane once it is down to one slice
+  bufferevent_setcb(evConn_, readCallback, bytes > 0 ? writeCallback : NULL, eventCallback, this);
+  bufferevent_setwatermark(evConn_, EV_WRITE, bytes, 0);
+  bufferevent_unlock(evConn_);
+}
+
+size_t RpcChannel::inputBytes() const
+{
+  return evbuffer_get_length(bufferevent_get_input(evConn_));
+}
+
+size_t RpcChannel::outputBytes() const
+{
+  return evbuffer_get_length(bufferevent_get_output(evConn_));
+}
+
+int RpcChannel::pendingRequests()
+{
+  muduo::MutexLockGuard lock(mutex_);
+  return pendingRequests_;
+}
+
+bool RpcChannel::idle()
+{
+  // a done callback writes the response before it counts the request done
+  return pendingRequests() == 0 && inputBytes() == 0 && outputBytes() == 0
+      && evbuffer_get_length(sliced_) == 0 && fragments_.empty();
+}
+
+void RpcChannel::flush()
+{
+  if (shm_)
+  {
+    return;
+  }
+  bufferevent_lock(evConn_);
+  struct evbuffer* output = bufferevent_get_output(evConn_);
+  if (evbuffer_get_length(output) > 0)
+  {
+    // the front of the output is frozen but for the bufferevent's writer
+    evbuffer_unfreeze(output, 1);
+    evbuffer_write(output, bufferevent_getfd(evConn_));
+    evbuffer_freeze(output, 1);
+  }
+  bufferevent_unlock(evConn_);
+}
+
+void RpcChannel::pauseReading()
+{
+  readPaused_ = true;
+  pauseIfWhole();
+}
+
+void RpcChannel::resumeReading()
+{
+  readPaused_ = false;
+  bufferevent_enable(evConn_, EV_READ);
+}
+
+// after each read, a frame half read is read to its end first
+void RpcChannel::pauseIfWhole()
+{
+  if (readPaused_ && inputBytes() == 0 && fragments_.empty())
+  {
+    bufferevent_disable(evConn_, EV_READ);
+  }
+}
+
+evutil_socket_t RpcChannel::fd() const
+{
+  return shm_ ? -1 : bufferevent_getfd(evConn_);
+}
+
 void RpcChannel::CallMethod(const gpb::MethodDescriptor* method,
                             gpb::RpcController* controller,
                             const gpb::Message* request,
@@ -83,22 +298,71 @@ void RpcChannel::CallMethod(const gpb::MethodDescriptor* method,
   message.set_request(request->SerializeAsString()); // FIXME: error check
 
   {
-  OutstandingCall out = { response, done };
+  OutstandingCall out = { response, done, controller };
   muduo::MutexLockGuard lock(mutex_);
   outstandings_[id] = out;
   }
 
-  sendMessage(message);
+  Priority priority = NORMAL;
+  if (sliceBytes_ > 0)
+  {
+    RpcController* rpcController = dynamic_cast<RpcController*>(controller);
+    priority = rpcController && rpcController->hasPriority_
+               ? rpcController->priority_ : RpcController::priorityOf(method);
+  }
+  sendMessage(message, priority);
 }
 
 void RpcChannel::onRead()
 {
+  lastActive_ = monotonicSeconds();
   struct evbuffer* input = bufferevent_get_input(evConn_);
-  ParseErrorCode errorCode = read(input, this);
+  if (resume_ == NULL && readStats_ == NULL)
+  {
+    ParseErrorCode errorCode = read(input, this);
+    if (errorCode != kNoError)
+    {
+      // FIXME:
+    }
+    return;
+  }
+
+  const int64_t start = monotonicNanos();
+  ReadBudget budget = { budgetFrames_, budgetNanos_ > 0 ? start + budgetNanos_ : 0, 0, false };
+  if (yieldedAt_ > 0)
+  {
+    if (readStats_)
+    {
+      readStats_->resumeNanos.add(start - yieldedAt_);
+      setMax(&readStats_->maxResumeNanos, start - yieldedAt_);
+    }
+    yieldedAt_ = 0;
+  }
+  ParseErrorCode errorCode = read(input, this, &budget);
   if (errorCode != kNoError)
   {
     // FIXME:
   }
+  const int64_t end = monotonicNanos();
+  if (budget.exhausted)
+  {
+    // a zero timeout runs after the next poll, so every other ready
+    // connection of this loop gets its turn first
+    yieldedAt_ = end;
+    struct timeval tv = { 0, 0 };
+    evtimer_add(resume_, &tv);
+  }
+  if (readStats_)
+  {
+    readStats_->callbacks.increment();
+    readStats_->frames.add(budget.frames);
+    readStats_->busyNanos.add(end - start);
+    setMax(&readStats_->maxCallbackNanos, end - start);
+    if (budget.exhausted)
+    {
+      readStats_->yields.increment();
+    }
+  }
 }
 
 void RpcChannel::onMessage(const RpcMessage& message)
@@ -108,7 +372,7 @@ void RpcChannel::onMessage(const RpcMessage& message)
     int64_t id = message.id();
     assert(message.has_response());
 
-    OutstandingCall out = { NULL, NULL };
+    OutstandingCall out = { NULL, NULL, NULL };
 
     {
       muduo::MutexLockGuard lock(mutex_);
@@ -141,14 +405,36 @@ void RpcChannel::onMessage(const RpcMessage& message)
       const gpb::ServiceDescriptor* desc = service->GetDescriptor();
       const gpb::MethodDescriptor* method
 	= desc->FindMethodByName(message.method());
+      if (method && responseCache_ && responseCache_->ttlOf(method) > 0)
+      {
+        RpcMessage cached;
+        cached.set_type(RESPONSE);
+        cached.set_id(message.id());
+        if (responseCache_->lookup(method, message.request(), cached.mutable_response()))
+        {
+          sendMessage(cached, RpcController::priorityOf(method));
+          return;
+        }
+      }
       if (method)
       {
 	gpb::Message* request = service->GetRequestPrototype(method).New();
 	request->ParseFromString(message.request());
 	gpb::Message* response = service->GetResponsePrototype(method).New();
-	int64_t id = message.id();
-	service->CallMethod(method, NULL, request, response,
-	    NewCallback(this, &RpcChannel::doneCallback, response, id));
+	RpcController* controller = new RpcController;
+	controller->id_ = message.id();
+	controller->priority_ = RpcController::priorityOf(method);
+	if (responseCache_ && responseCache_->ttlOf(method) > 0)
+	{
+	  controller->cacheMethod_ = method;
+	  controller->cacheRequest_ = message.request();
+	}
+	{
+	muduo::MutexLockGuard lock(mutex_);
+	++pendingRequests_;
+	}
+	service->CallMethod(method, controller, request, response,
+	    NewCallback(this, &RpcChannel::doneCallback, response, controller));
         delete request;
       }
       else
@@ -163,19 +449,149 @@ void RpcChannel::onMessage(const RpcMessage& message)
   }
 }
 
-void RpcChannel::doneCallback(::google::protobuf::Message* response, int64_t id)
+// may run in any thread, eg. when the service completes asynchronously.
+void RpcChannel::doneCallback(::google::protobuf::Message* response, RpcController* controller)
 {
-  RpcMessage message;
-  message.set_type(RESPONSE);
-  message.set_id(id);
-  message.set_response(response->SerializeAsString()); // FIXME: error check
-  sendMessage(message);
+  bool closing = false;
+  {
+  muduo::MutexLockGuard lock(mutex_);
+  closing = closing_;
+  }
+
+  if (!closing)
+  {
+    RpcMessage message;
+    message.set_type(RESPONSE);
+    message.set_id(controller->id_);
+    RpcController::Attachment& a = controller->attachment_;
+    if (a.data)
+    {
+      // the output buffer owns it from now on
+      struct evbuffer* frame = evbuffer_new();
+      encodeWithAttachment(frame, message, *response, a.field, a.data, a.len, a.cleanup, a.arg);
+      a.data = NULL;
+      sendFrame(frame, controller->priority_);
+      evbuffer_free(frame);
+    }
+    else
+    {
+      message.set_response(response->SerializeAsString()); // FIXME: error check
+      if (controller->cacheMethod_ && !controller->Failed())
+      {
+        responseCache_->insert(controller->cacheMethod_, controller->cacheRequest_,
+                               message.response());
+      }
+      sendMessage(message, controller->priority_);
+    }
+  }
   delete response;
+  delete controller;
+
+  bool last = false;
+  {
+  muduo::MutexLockGuard lock(mutex_);
+  --pendingRequests_;
+  last = closing_ && pendingRequests_ == 0;
+  }
+  if (last)
+  {
+    delete this;
+  }
 }
 
-void RpcChannel::sendMessage(const RpcMessage& message)
+void RpcChannel::failOutstandings(const std::string& reason)
 {
-  send(evConn_, message);
+  std::map<int64_t, OutstandingCall> outstandings;
+  {
+  muduo::MutexLockGuard lock(mutex_);
+  outstandings.swap(outstandings_);
+  }
+
+  for (std::map<int64_t, OutstandingCall>::iterator it = outstandings.begin();
+       it != outstandings.end();
+       ++it)
+  {
+    OutstandingCall& out = it->second;
+    if (out.controller)
+    {
+      out.controller->SetFailed(reason);
+    }
+    if (out.done)
+    {
+      out.done->Run();
+    }
+    delete out.response;
+  }
+}
+
+void RpcChannel::sendMessage(const RpcMessage& message, Priority priority)
+{
+  if (sliceBytes_ == 0)
+  {
+    send(evConn_, message);
+    return;
+  }
+  struct evbuffer* frame = evbuffer_new();
+  encode(frame, message);
+  sendFrame(frame, priority);
+  evbuffer_free(frame);
+}
+
+void RpcChannel::sendFrame(struct evbuffer* frame, Priority priority)
+{
+  const size_t len = evbuffer_get_length(frame);
+  if (sliceBytes_ == 0 || priority == HIGH || (priority == NORMAL && len <= sliceBytes_))
+  {
+    bufferevent_write_buffer(evConn_, frame);
+  }
+  else
+  {
+    bufferevent_lock(evConn_);
+    evbuffer_add_buffer(sliced_, frame);
+    pumpSlices();
+    bufferevent_unlock(evConn_);
+  }
+}
+
+void RpcChannel::setReadBudget(int frames, int micros)
+{
+  budgetFrames_ = frames;
+  budgetNanos_ = static_cast<int64_t>(micros) * 1000;
+  if (resume_ == NULL && (frames > 0 || micros > 0))
+  {
+    resume_ = evtimer_new(bufferevent_get_base(evConn_), resumeCallback, this);
+  }
+}
+
+void RpcChannel::setReadStats(ReadStats* stats)
+{
+  readStats_ = stats;
+}
+
+// Tops up the output with slices from the low lane, one slice deep at most,
+// the rest waits for writeCallback().
+void RpcChannel::pumpSlices()
+{
+  struct evbuffer* output = bufferevent_get_output(evConn_);
+  while (evbuffer_get_length(sliced_) > 0 && evbuffer_get_length(output) < sliceBytes_)
+  {
+    if (slicedLeft_ == 0)
+    {
+      int be32 = 0;
+      evbuffer_copyout(sliced_, &be32, sizeof be32);
+      slicedLeft_ = ntohl(be32) + 4;
+      if (slicedLeft_ <= sliceBytes_)
+      {
+        // fits in a slice, goes whole
+        evbuffer_remove_buffer(sliced_, output, slicedLeft_);
+        slicedLeft_ = 0;
+        continue;
+      }
+    }
+    size_t n = std::min(sliceBytes_, slicedLeft_);
+    slicedLeft_ -= n;
+    sendFragment(evConn_, sliced_, n, slicedLeft_ == 0);
+  }
 }
 
 void RpcChannel::connectFailed()
@@ -194,6 +610,8 @@ void RpcChannel::connected()
 
 void RpcChannel::disconnected()
 {
+  // no response will come
+  failOutstandings(connectFailed_ ? "connect failed" : "disconnected");
   if (disconnect_cb_)
   {
     disconnect_cb_(this, ptr_);
@@ -205,6 +623,32 @@ void RpcChannel::readCallback(struct bufferevent* bev, void* ptr)
   RpcChannel* self = static_cast<RpcChannel*>(ptr);
   assert(self->evConn_ == bev);
   self->onRead();
+  self->pauseIfWhole();
+}
+
+void RpcChannel::bufferCallback(struct evbuffer* buffer,
+                                const struct evbuffer_cb_info* info, void* ptr)
+{
+  RpcChannel* self = static_cast<RpcChannel*>(ptr);
+  self->bufferedBytes_->add(static_cast<int64_t>(info->n_added)
+                            - static_cast<int64_t>(info->n_deleted));
+}
+
+void RpcChannel::writeCallback(struct bufferevent* bev, void* ptr)
+{
+  RpcChannel* self = static_cast<RpcChannel*>(ptr);
+  assert(self->evConn_ == bev);
+  // called with bev locked
+  self->pumpSlices();
+}
+
+void RpcChannel::resumeCallback(evutil_socket_t, short, void* ptr)
+{
+  RpcChannel* self = static_cast<RpcChannel*>(ptr);
+  bufferevent_lock(self->evConn_);
+  self->onRead();
+  self->pauseIfWhole();
+  bufferevent_unlock(self->evConn_);
 }
 
 void RpcChannel::eventCallback(struct bufferevent* bev, short events, void* ptr)
@@ -13,10 +13,15 @@
 #include <google/protobuf/service.h>
 #include <google/protobuf/descriptor.h>
 
+#include <event2/buffer.h>
 #include <event2/bufferevent.h>
+#include <event2/event.h>
 
 #include "muduo/Atomic.h"
 #include "muduo/Mutex.h"
+#include "rpc.pb.h"
+
+#include <time.h>
 
 #include <map>
 #include <string>
@@ -25,21 +30,102 @@ namespace evproto
 {
 
 class EventLoop;
-class RpcMessage;
+class ResponseCache;
+class RpcController;
+class ShmPipe;
 
 namespace gpb = ::google::protobuf;
 
+// seconds, for idle timeouts; a few ms stale, but no syscall
+inline time_t monotonicSeconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec;
+}
+
+inline int64_t monotonicNanos()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Read side counters of the channels of one loop, written in its thread.
+struct ReadStats // : boost::noncopyable
+{
+  muduo::AtomicInt64 callbacks;         // read callbacks and resumes
+  muduo::AtomicInt64 frames;
+  muduo::AtomicInt64 yields;            // out of budget with frames left
+  muduo::AtomicInt64 busyNanos;         // dispatching frames
+  muduo::AtomicInt64 maxCallbackNanos;  // longest one connection held the loop
+  muduo::AtomicInt64 resumeNanos;       // from yield to resume, total
+  muduo::AtomicInt64 maxResumeNanos;
+};
+
 class RpcChannel : public gpb::RpcChannel
 {
  public:
   typedef void (*disconnect_cb)(RpcChannel*, void* ptr);
 
+  // A host starting with '/' is the path of an RpcServer::listenShm(),
+  // port is ignored then.
   RpcChannel(EventLoop* loop, const std::string& host, int port);
   RpcChannel(struct event_base *base, int fd, const std::map<std::string, gpb::Service*>&);
+  // Server side, owns pipe.
+  RpcChannel(ShmPipe* pipe, const std::map<std::string, gpb::Service*>&);
   ~RpcChannel();
 
   void setDisconnectCb(disconnect_cb cb, void* ptr);
 
+  // Server side, deletes this now or when the last request in service is done.
+  void close();
+
+  // Server side, keeps counter up to date with the bytes in the input and
+  // output buffers, until this is deleted.
+  void setBufferedBytesCounter(muduo::AtomicInt64* counter);
+
+  // Call before use. Frames larger than bytes, and LOW priority ones, wait
+  // in a low lane and go out in slices of bytes, so HIGH priority and small
+  // frames are never stuck behind them. The peer must understand fragment
+  // frames, any RpcChannel of this version does. 0 (default) sends every
+  // frame whole, in order.
+  void setSliceBytes(size_t bytes);
+
+  // Call before use. One read callback dispatches at most frames frames
+  // and for at most micros, 0 for no limit (default), then yields the loop
+  // to other connections and resumes in its next iteration.
+  void setReadBudget(int frames, int micros);
+  // Call before use, stats is added to by this channel.
+  void setReadStats(ReadStats* stats);
+  // Server side, call before use. Answers requests of the methods cached
+  // by cache from it, and fills it.
+  void setResponseCache(ResponseCache* cache) { responseCache_ = cache; }
+  size_t inputBytes() const;
+  size_t outputBytes() const;
+  // monotonicSeconds() of the last read, only for the loop thread
+  time_t lastActive() const { return lastActive_; }
+  int pendingRequests();
+  // Client side. Fails every call still waiting for its response: its
+  // controller is SetFailed(reason) and done is run, which may call again.
+  // Done when the connection closes or fails to connect, before the
+  // disconnect callback, so a done must not delete this.
+  void failOutstandings(const std::string& reason);
+  // Server side, in the loop thread. Nothing in service, buffered or half
+  // read, so the connection can carry on in another process as it is.
+  bool idle();
+  // Server side, in the loop thread. Writes out what the output holds, as
+  // far as the socket takes it now, rather than once the loop polls next.
+  // Nothing for a ShmPipe.
+  void flush();
+  // Server side, in the loop thread. Stops reading requests once no frame
+  // is half read, what the peer sends next stays in the socket, so that a
+  // busy connection goes idle() for a hand-off. resumeReading() undoes it.
+  void pauseReading();
+  void resumeReading();
+  // the socket, -1 for a ShmPipe
+  evutil_socket_t fd() const;
+
   void CallMethod(const gpb::MethodDescriptor* method,
                   gpb::RpcController* controller,
                   const gpb::Message* request,
@@ -47,36 +133,64 @@ class RpcChannel : public gpb::RpcChannel
                   gpb::Closure* done);
 
   void onMessage(const RpcMessage&);
+  // frame being reassembled from fragments, for read()
+  std::string* fragments() { return &fragments_; }
 
  private:
   void onRead();
-  void sendMessage(const RpcMessage&);
-  void doneCallback(::google::protobuf::Message* response, int64_t id);
+  void pauseIfWhole();
+  void sendMessage(const RpcMessage&, Priority priority);
+  void sendFrame(struct evbuffer* frame, Priority priority);
+  void pumpSlices();
+  void doneCallback(::google::protobuf::Message* response, RpcController* controller);
 
   void connectFailed();
   void connected();
   void disconnected();
 
   static void readCallback(struct bufferevent *bev, void *ptr);
+  static void writeCallback(struct bufferevent *bev, void *ptr);
+  static void resumeCallback(evutil_socket_t, short, void* ptr);
   static void eventCallback(struct bufferevent *bev, short events, void *ptr);
+  static void bufferCallback(struct evbuffer* buffer,
+                             const struct evbuffer_cb_info* info, void* ptr);
 
   struct OutstandingCall
   {
     ::google::protobuf::Message* response;
     ::google::protobuf::Closure* done;
+    ::google::protobuf::RpcController* controller;
   };
 
+  ShmPipe* shm_;
   struct bufferevent* evConn_;
   bool connectFailed_;
   disconnect_cb disconnect_cb_;
   void* ptr_;
+  muduo::AtomicInt64* bufferedBytes_;
+  time_t lastActive_;
 
   muduo::AtomicInt64 id_;
 
   muduo::MutexLock mutex_;
   std::map<int64_t, OutstandingCall> outstandings_;
+  int pendingRequests_;
+  bool closing_;
 
   std::map<std::string, gpb::Service*> services_;
+
+  size_t sliceBytes_;
+  struct evbuffer* sliced_;   // low lane, guarded by bufferevent_lock(evConn_)
+  size_t slicedLeft_;         // of the frame at the front of sliced_
+  std::string fragments_;
+  bool readPaused_;
+
+  int budgetFrames_;
+  int64_t budgetNanos_;
+  struct event* resume_;      // after a yield
+  int64_t yieldedAt_;
+  ReadStats* readStats_;
+  ResponseCache* responseCache_;
 };
 
 }
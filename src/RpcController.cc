@@ -0,0 +1,81 @@
+#include "RpcController.h"
+
+using namespace evproto;
+
+RpcController::RpcController()
+  : id_(0),
+    priority_(NORMAL),
+    hasPriority_(false),
+    cacheMethod_(NULL),
+    failed_(false)
+{
+  attachment_.data = NULL;
+}
+
+RpcController::~RpcController()
+{
+  releaseAttachment();
+}
+
+void RpcController::setResponseAttachment(int field, const void* data, size_t len,
+                                          cleanup_cb cleanup, void* arg)
+{
+  releaseAttachment();
+  Attachment a = { field, data, len, cleanup, arg };
+  attachment_ = a;
+}
+
+Priority RpcController::priorityOf(const gpb::MethodDescriptor* method)
+{
+  const gpb::MethodOptions& options = method->options();
+  return options.HasExtension(evproto::priority) ? options.GetExtension(evproto::priority) : NORMAL;
+}
+
+void RpcController::releaseAttachment()
+{
+  if (attachment_.data && attachment_.cleanup)
+  {
+    attachment_.cleanup(attachment_.data, attachment_.len, attachment_.arg);
+  }
+  attachment_.data = NULL;
+}
+
+void RpcController::Reset()
+{
+  releaseAttachment();
+  priority_ = NORMAL;
+  hasPriority_ = false;
+  cacheMethod_ = NULL;
+  cacheRequest_.clear();
+  failed_ = false;
+  reason_.clear();
+}
+
+bool RpcController::Failed() const
+{
+  return failed_;
+}
+
+std::string RpcController::ErrorText() const
+{
+  return reason_;
+}
+
+void RpcController::StartCancel()
+{
+}
+
+void RpcController::SetFailed(const std::string& reason)
+{
+  failed_ = true;
+  reason_ = reason;
+}
+
+bool RpcController::IsCanceled() const
+{
+  return false;
+}
+
+void RpcController::NotifyOnCancel(gpb::Closure* callback)
+{
+}
@@ -0,0 +1,92 @@
+// Copyright 2010, Shuo Chen.  All rights reserved.
+// http://code.google.com/p/evproto2
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+// Author: Shuo Chen (chenshuo at chenshuo dot com)
+//
+
+#ifndef EVPROTO2_RPCCONTROLLER_H
+#define EVPROTO2_RPCCONTROLLER_H
+
+#include "rpc.pb.h"
+
+#include <google/protobuf/service.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace evproto
+{
+
+namespace gpb = ::google::protobuf;
+
+class RpcChannel;
+
+// Passed to services by RpcChannel, one per request.
+class RpcController : public gpb::RpcController
+{
+ public:
+  // same as evbuffer_ref_cleanup_cb
+  typedef void (*cleanup_cb)(const void* data, size_t len, void* arg);
+
+  RpcController();
+  ~RpcController();
+
+  // Server side. Sends len bytes at data as bytes field number 'field' of
+  // the response, the field itself must be left unset. The bytes go to the
+  // socket by reference, without being copied, and must stay valid until
+  // cleanup(data, len, arg) is called, in any thread.
+  void setResponseAttachment(int field, const void* data, size_t len,
+                             cleanup_cb cleanup, void* arg);
+
+  // The lane of the request, or of the response on the server side.
+  // Defaults to the priority option of the method, else NORMAL.
+  void setPriority(Priority priority) { priority_ = priority; hasPriority_ = true; }
+  Priority priority() const { return priority_; }
+  // false until setPriority(), the method option applies then
+  bool hasPriority() const { return hasPriority_; }
+
+  static Priority priorityOf(const gpb::MethodDescriptor* method);
+
+  void Reset();
+  bool Failed() const;
+  std::string ErrorText() const;
+  void StartCancel();
+  void SetFailed(const std::string& reason);
+  bool IsCanceled() const;
+  void NotifyOnCancel(gpb::Closure* callback);
+
+ private:
+  friend class RpcChannel;
+
+  struct Attachment
+  {
+    int field;
+    const void* data;
+    size_t len;
+    cleanup_cb cleanup;
+    void* arg;
+  };
+
+  void releaseAttachment();
+
+  int64_t id_;
+  Attachment attachment_;
+  Priority priority_;
+  bool hasPriority_;
+  // server side, set if the response goes to the ResponseCache
+  const gpb::MethodDescriptor* cacheMethod_;
+  std::string cacheRequest_;
+  bool failed_;
+  std::string reason_;
+
+  void operator=(const RpcController&);
+  RpcController(const RpcController&);
+};
+
+}
+
+#endif  // EVPROTO2_RPCCONTROLLER_H
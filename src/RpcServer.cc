@@ -1,9 +1,68 @@
 #include "RpcServer.h"
 #include "RpcChannel.h"
+#include "RpcController.h"
+#include "ResponseCache.h"
+#include "ShmPipe.h"
+#include "SocketsOps.h"
 #include "EventLoop.h"
 
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+
 using namespace evproto;
 
+namespace
+{
+
+struct NewChannel
+{
+  void* loop;
+  evutil_socket_t fd;
+  size_t ringBytes;   // ShmPipe, 0 for a TCP connection
+};
+
+// hot restart messages, on a SOCK_SEQPACKET Unix socket
+const uint32_t kRestartMagic = 0x52535430;  // "RST0"
+const uint32_t kListener = 1;      // one fd
+const uint32_t kConnections = 2;   // up to kMaxFds fds
+const uint32_t kReleased = 3;      // no fd, done serving, see setHandOffCallbacks()
+const int kMaxFds = 64;
+
+struct RestartHeader
+{
+  uint32_t magic;
+  uint32_t type;
+};
+
+struct sockaddr_un unixAddress(const std::string& path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  assert(path.size() < sizeof addr.sun_path);
+  strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+  return addr;
+}
+
+struct Victim
+{
+  RpcChannel* channel;
+  int64_t bytes;
+  time_t lastActive;
+
+  bool operator<(const Victim& rhs) const
+  {
+    return bytes > rhs.bytes || (bytes == rhs.bytes && lastActive < rhs.lastActive);
+  }
+};
+
+}
+
 struct sockaddr* getListenSock(int port)
 {
   static struct sockaddr_in sin;
@@ -14,31 +73,171 @@ struct sockaddr* getListenSock(int port)
 }
 
 RpcServer::RpcServer(EventLoop* loop, int port)
-  : evListener_(evconnlistener_new_bind(loop->eventBase(),
+  : base_(loop->eventBase()),
+    evListener_(evconnlistener_new_bind(loop->eventBase(),
         newConnectionCallback, this, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
         getListenSock(port), sizeof(struct sockaddr_in))),
-    currLoop_(0)
+    shmListener_(NULL),
+    shmRingBytes_(0),
+    currLoop_(0),
+    idleTimeout_(0),
+    memoryBudget_(0),
+    sliceBytes_(0),
+    budgetFrames_(0),
+    budgetMicros_(0),
+    responseCache_(NULL),
+    restartSock_(-1),
+    restartEvent_(NULL),
+    successor_(-1),
+    successorEvent_(NULL),
+    drainedTimer_(NULL),
+    drainSeconds_(10),
+    port_(port),
+    predecessor_(-1),
+    predecessorEvent_(NULL),
+    released_(false),
+    acquire_(NULL),
+    release_(NULL),
+    handOffArg_(NULL),
+    holding_(false)
+{
+  loops_.push_back(newLoop(loop->eventBase()));
+}
+
+RpcServer::RpcServer(EventLoop* loop, int port, const std::string& restartPath)
+  : base_(loop->eventBase()),
+    evListener_(NULL),
+    shmListener_(NULL),
+    shmRingBytes_(0),
+    currLoop_(0),
+    idleTimeout_(0),
+    memoryBudget_(0),
+    sliceBytes_(0),
+    budgetFrames_(0),
+    budgetMicros_(0),
+    responseCache_(NULL),
+    restartSock_(-1),
+    restartEvent_(NULL),
+    successor_(-1),
+    successorEvent_(NULL),
+    drainedTimer_(NULL),
+    drainSeconds_(10),
+    port_(port),
+    predecessor_(-1),
+    predecessorEvent_(NULL),
+    released_(false),
+    acquire_(NULL),
+    release_(NULL),
+    handOffArg_(NULL),
+    holding_(false)
 {
-  loops_.push_back(loop->eventBase());
+  loops_.push_back(newLoop(loop->eventBase()));
+  if (restartPath.empty())
+  {
+    listenPort();
+  }
+  else if (!takeOver(restartPath))
+  {
+    listenPort();
+    listenRestart(restartPath);
+  }
 }
 
 RpcServer::~RpcServer()
 {
   // struct event_base* base = evconnlistener_get_base(evListener_);
-  evconnlistener_free(evListener_);
-  if (loops_.size() > 1)
+  if (evListener_)
+  {
+    evconnlistener_free(evListener_);
+  }
+  if (predecessorEvent_)
+  {
+    event_free(predecessorEvent_);
+    ::close(predecessor_);
+  }
+  for (size_t i = 0; i < adopted_.size(); ++i)
+  {
+    ::close(adopted_[i]);
+  }
+  for (size_t i = 0; i < held_.size(); ++i)
+  {
+    ::close(held_[i].first);
+  }
+  if (shmListener_)
+  {
+    evconnlistener_free(shmListener_);
+    // after a hand-off, the path is the successor's
+    if (!shmPath_.empty() && successor_ < 0)
+    {
+      ::unlink(shmPath_.c_str());
+    }
+  }
+  if (restartEvent_)
+  {
+    event_free(restartEvent_);
+    ::close(restartSock_);
+    ::unlink(restartPath_.c_str());
+  }
+  if (successorEvent_)
   {
-    for (size_t i = 0; i < loops_.size(); ++i)
+    event_free(successorEvent_);
+  }
+  if (drainedTimer_)
+  {
+    event_free(drainedTimer_);
+  }
+  // successor_ stays open until this process exits, the successor waits
+  // for that before it goes on
+  for (size_t i = 0; i < loops_.size(); ++i)
+  {
+    if (loops_[i]->timer)
+    {
+      event_free(loops_[i]->timer);
+    }
+    if (loops_[i]->drainTimer)
+    {
+      event_free(loops_[i]->drainTimer);
+    }
+    if (loops_[i]->successor >= 0)
+    {
+      ::close(loops_[i]->successor);
+    }
+    if (loops_.size() > 1)
     {
-      event_base_free(loops_[i]);
+      event_base_free(loops_[i]->base);
     }
+    delete loops_[i];
   }
+  delete responseCache_;
+}
+
+RpcServer::Loop* RpcServer::newLoop(struct event_base* base)
+{
+  Loop* loop = new Loop;
+  loop->server = this;
+  loop->base = base;
+  loop->timer = NULL;
+  loop->lastTick = 0;
+  loop->drainTimer = NULL;
+  loop->drainDeadline = 0;
+  loop->successor = -1;
+  if (idleTimeout_ > 0)
+  {
+    loop->wheel.resize(idleTimeout_ + 1);
+  }
+  return loop;
 }
 
 void RpcServer::setThreadNum(int numThreads)
 {
   if (numThreads > 1)
   {
+    assert(loops_.size() == 1);
+    if (loops_[0]->timer)
+    {
+      event_free(loops_[0]->timer);
+    }
+    delete loops_[0];
     loops_.clear();
     for (int i = 0; i < numThreads; ++i)
     {
@@ -46,7 +245,89 @@ void RpcServer::setThreadNum(int numThreads)
       pthread_t t;
       pthread_create(&t, NULL, runLoop, base);
       pthread_detach(t);
-      loops_.push_back(base);
+      loops_.push_back(newLoop(base));
+    }
+    startTimers();
+  }
+}
+
+void RpcServer::setIdleTimeout(int seconds)
+{
+  idleTimeout_ = seconds;
+  for (size_t i = 0; i < loops_.size(); ++i)
+  {
+    assert(loops_[i]->channels.empty());
+    loops_[i]->wheel.clear();
+    if (idleTimeout_ > 0)
+    {
+      // a deadline is at most idleTimeout_ ahead, so slots never wrap onto it
+      loops_[i]->wheel.resize(idleTimeout_ + 1);
+    }
+  }
+  startTimers();
+}
+
+void RpcServer::setResponseCache(size_t bytes)
+{
+  assert(responseCache_ == NULL);
+  responseCache_ = new ResponseCache(bytes);
+  for (std::map<std::string, gpb::Service*>::iterator it = services_.begin();
+       it != services_.end(); ++it)
+  {
+    cacheByOptions(it->second);
+  }
+}
+
+void RpcServer::cacheResponses(const gpb::MethodDescriptor* method, int millis)
+{
+  assert(responseCache_ != NULL);
+  responseCache_->setTtl(method, millis);
+}
+
+void RpcServer::cacheByOptions(gpb::Service* service)
+{
+  const gpb::ServiceDescriptor* desc = service->GetDescriptor();
+  for (int i = 0; i < desc->method_count(); ++i)
+  {
+    const gpb::MethodOptions& options = desc->method(i)->options();
+    if (options.HasExtension(cache_ttl_ms))
+    {
+      responseCache_->setTtl(desc->method(i), options.GetExtension(cache_ttl_ms));
+    }
+  }
+}
+
+void RpcServer::setMemoryBudget(int64_t bytes)
+{
+  memoryBudget_ = bytes;
+  startTimers();
+}
+
+int64_t RpcServer::memoryUsage() const
+{
+  int64_t usage = numConnections_.get() * kConnectionCharge;
+  for (size_t i = 0; i < loops_.size(); ++i)
+  {
+    usage += loops_[i]->bufferedBytes.get();
+  }
+  return usage;
+}
+
+void RpcServer::startTimers()
+{
+  if (idleTimeout_ <= 0 && memoryBudget_ <= 0)
+  {
+    return;
+  }
+  for (size_t i = 0; i < loops_.size(); ++i)
+  {
+    Loop* loop = loops_[i];
+    if (loop->timer == NULL)
+    {
+      loop->lastTick = monotonicSeconds();
+      loop->timer = event_new(loop->base, -1, EV_PERSIST, timerCallback, loop);
+      struct timeval tv = { 1, 0 };
+      event_add(loop->timer, &tv);
     }
   }
 }
@@ -74,36 +355,554 @@ void* RpcServer::runLoop(void* ptr)
   return NULL;
 }
 
+void RpcServer::setHandOffCallbacks(handoff_cb acquire, handoff_cb release, void* arg)
+{
+  acquire_ = acquire;
+  release_ = release;
+  handOffArg_ = arg;
+  if (predecessor_ < 0)
+  {
+    acquire_(handOffArg_);
+  }
+  else
+  {
+    holding_ = true;
+  }
+}
+
 void RpcServer::registerService(gpb::Service* service)
 {
   const google::protobuf::ServiceDescriptor* desc = service->GetDescriptor();
   services_[desc->name()] = service;
+  if (responseCache_)
+  {
+    cacheByOptions(service);
+  }
+}
+
+void RpcServer::listenShm(const std::string& path, size_t ringBytes)
+{
+  assert(shmListener_ == NULL);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  assert(path.size() < sizeof addr.sun_path);
+  strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+  // left by an earlier run
+  ::unlink(path.c_str());
+  shmPath_ = path;
+  shmRingBytes_ = ringBytes;
+  shmListener_ = evconnlistener_new_bind(base_,
+      newShmConnectionCallback, this, LEV_OPT_CLOSE_ON_FREE, -1,
+      reinterpret_cast<struct sockaddr*>(&addr), sizeof addr);
+}
+
+void RpcServer::listenPort()
+{
+  evListener_ = evconnlistener_new_bind(base_,
+      newConnectionCallback, this, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
+      getListenSock(port_), sizeof(struct sockaddr_in));
+}
+
+// Connects to the predecessor at path, false if there is none.
+bool RpcServer::takeOver(const std::string& path)
+{
+  struct sockaddr_un addr = unixAddress(path);
+  int sock = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0 || ::connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) != 0)
+  {
+    if (sock >= 0)
+    {
+      ::close(sock);
+    }
+    return false;
+  }
+  evutil_make_socket_nonblocking(sock);
+  restartPath_ = path;
+  predecessor_ = sock;
+  predecessorEvent_ = event_new(base_, sock, EV_READ | EV_PERSIST, predecessorCallback, this);
+  event_add(predecessorEvent_, NULL);
+  return true;
+}
+
+// The listening socket, then connections as they go idle, then kReleased
+// once it has served its last request, then the end of stream when the
+// predecessor is gone, with everything it held. Reads what is there, true
+// at the end.
+bool RpcServer::receiveHandOff()
+{
+  RestartHeader header;
+  int fds[kMaxFds];
+  for (;;)
+  {
+    int n = sockets::recvFds(predecessor_, &header, sizeof header, fds, kMaxFds);
+    if (n < 0)
+    {
+      if (errno == EINTR || errno == EPROTO)
+      {
+        // EPROTO, a malformed message, dropped with its descriptors
+        continue;
+      }
+      return errno != EAGAIN && errno != EWOULDBLOCK;
+    }
+    for (int i = 0; i < n; ++i)
+    {
+      if (header.magic == kRestartMagic && header.type == kListener && evListener_ == NULL)
+      {
+        // listening already
+        evListener_ = evconnlistener_new(base_, newConnectionCallback, this,
+            LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 0, fds[i]);
+      }
+      else if (header.magic == kRestartMagic && header.type == kConnections)
+      {
+        adopted_.push_back(fds[i]);
+      }
+      else
+      {
+        ::close(fds[i]);
+      }
+    }
+    if (header.magic == kRestartMagic && header.type == kReleased)
+    {
+      released_ = true;
+    }
+  }
+}
+
+void RpcServer::onPredecessor()
+{
+  bool gone = receiveHandOff();
+  for (size_t i = 0; i < adopted_.size(); ++i)
+  {
+    onConnect(adopted_[i], 0);
+  }
+  adopted_.clear();
+  if (holding_ && (released_ || gone))
+  {
+    acquire();
+  }
+  if (gone)
+  {
+    tookOver();
+  }
+}
+
+// The predecessor holds nothing the service needs any more, take it and
+// serve the connections held meanwhile.
+void RpcServer::acquire()
+{
+  holding_ = false;
+  acquire_(handOffArg_);
+  std::vector<std::pair<int, size_t> > held;
+  held.swap(held_);
+  for (size_t i = 0; i < held.size(); ++i)
+  {
+    onConnect(held[i].first, held[i].second);
+  }
+}
+
+// The predecessor has exited, we are on our own.
+void RpcServer::tookOver()
+{
+  event_free(predecessorEvent_);
+  predecessorEvent_ = NULL;
+  ::close(predecessor_);
+  predecessor_ = -1;
+  if (evListener_ == NULL)
+  {
+    listenPort();
+  }
+  std::string path = restartPath_;
+  listenRestart(path);
+}
+
+void RpcServer::listenRestart(const std::string& path)
+{
+  struct sockaddr_un addr = unixAddress(path);
+  // left by an earlier run, or by the predecessor
+  ::unlink(path.c_str());
+  restartSock_ = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (restartSock_ < 0
+      || ::bind(restartSock_, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) != 0
+      || ::listen(restartSock_, 1) != 0)
+  {
+    perror("listenRestart");
+    if (restartSock_ >= 0)
+    {
+      ::close(restartSock_);
+    }
+    restartSock_ = -1;
+    return;
+  }
+  restartPath_ = path;
+  restartEvent_ = event_new(base_, restartSock_, EV_READ | EV_PERSIST, successorCallback, this);
+  event_add(restartEvent_, NULL);
 }
 
-void RpcServer::onConnect(evutil_socket_t fd)
+void RpcServer::onSuccessor()
 {
-  struct event_base* base = loops_[currLoop_];
+  // non-blocking, a full socket buffer fails a chunk of drain() instead of
+  // stalling its loop
+  int sock = ::accept4(restartSock_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (sock < 0)
+  {
+    return;
+  }
+  RestartHeader header = { kRestartMagic, kListener };
+  int fd = evconnlistener_get_fd(evListener_);
+  if (!sockets::sendFds(sock, &header, sizeof header, &fd, 1))
+  {
+    ::close(sock);
+    return;
+  }
+
+  // one successor, and it listens at restartPath_ next
+  event_free(restartEvent_);
+  restartEvent_ = NULL;
+  ::close(restartSock_);
+  restartSock_ = -1;
+  successor_ = sock;
+  // it sends nothing, readable means it is gone
+  successorEvent_ = event_new(base_, sock, EV_READ | EV_PERSIST, successorLostCallback, this);
+  event_add(successorEvent_, NULL);
+  evconnlistener_disable(evListener_);
+  if (shmListener_)
+  {
+    // shm clients are not handed over, they reconnect to the path, which
+    // the successor binds anew
+    evconnlistener_disable(shmListener_);
+  }
+
+  // the last loop to drain fires it early
+  if (drainedTimer_ == NULL)
+  {
+    drainedTimer_ = evtimer_new(base_, drainedCallback, this);
+  }
+  struct timeval tv = { drainSeconds_ + 1, 0 };
+  evtimer_add(drainedTimer_, &tv);
+  drainingLoops_.getAndSet(static_cast<int32_t>(loops_.size()));
+  for (size_t i = 0; i < loops_.size(); ++i)
+  {
+    // each loop closes its own, whenever it is done with it
+    loops_[i]->successor = ::dup(sock);
+    event_base_once(loops_[i]->base, -1, EV_TIMEOUT, drainCallback, loops_[i], NULL);
+  }
+}
+
+// The successor died or gave up before we were done, so serve on: take
+// back the listeners and keep the connections not handed over yet.
+void RpcServer::onSuccessorLost()
+{
+  char buf[sizeof(RestartHeader)];
+  ssize_t n = ::recv(successor_, buf, sizeof buf, MSG_DONTWAIT);
+  if (n > 0 || (n < 0 && (errno == EAGAIN || errno == EINTR)))
+  {
+    return;
+  }
+
+  event_free(successorEvent_);
+  successorEvent_ = NULL;
+  ::close(successor_);
+  successor_ = -1;
+  // a loop may still fire it, drainedCallback ignores it then
+  evtimer_del(drainedTimer_);
+  for (size_t i = 0; i < loops_.size(); ++i)
+  {
+    event_base_once(loops_[i]->base, -1, EV_TIMEOUT, undrainCallback, loops_[i], NULL);
+  }
+
+  evconnlistener_enable(evListener_);
+  if (shmListener_)
+  {
+    // the successor may have bound the path to its own socket
+    evconnlistener_free(shmListener_);
+    shmListener_ = NULL;
+    std::string path = shmPath_;
+    listenShm(path, shmRingBytes_);
+  }
+  std::string path = restartPath_;
+  listenRestart(path);
+}
+
+// In the loop thread, every 50ms until the loop has no connection left.
+void RpcServer::drain(Loop* loop)
+{
+  if (loop->successor < 0)
+  {
+    // undrained already
+    return;
+  }
+  if (loop->drainTimer == NULL)
+  {
+    loop->drainTimer = evtimer_new(loop->base, drainCallback, loop);
+    loop->drainDeadline = monotonicSeconds() + drainSeconds_;
+  }
+
+  std::vector<RpcChannel*> idle;
+  std::vector<RpcChannel*> shm;
+  std::vector<int> fds;
+  for (std::map<RpcChannel*, int>::iterator it = loop->channels.begin();
+       it != loop->channels.end(); ++it)
+  {
+    // what its peer sends next waits in the socket, for the successor;
+    // else a busy connection is idle only between a response and the next
+    // request, and the round rarely comes right then
+    it->first->pauseReading();
+    if (it->first->pendingRequests() == 0)
+    {
+      // its last response would go out only when the loop polls next
+      it->first->flush();
+    }
+    if (!it->first->idle())
+    {
+      continue;
+    }
+    if (it->first->fd() >= 0)
+    {
+      idle.push_back(it->first);
+      fds.push_back(it->first->fd());
+    }
+    else
+    {
+      // shm clients are not handed over, they reconnect
+      shm.push_back(it->first);
+    }
+  }
+
+  // closing our copy leaves the successor's open, the peer sees nothing;
+  // the channels of a chunk not sent stay here, for the next round
+  RestartHeader header = { kRestartMagic, kConnections };
+  for (size_t i = 0; i < fds.size(); i += kMaxFds)
+  {
+    const int n = static_cast<int>(std::min(fds.size() - i, static_cast<size_t>(kMaxFds)));
+    if (!sockets::sendFds(loop->successor, &header, sizeof header, &fds[i], n))
+    {
+      break;
+    }
+    for (int j = 0; j < n; ++j)
+    {
+      closeChannel(loop, idle[i + j]);
+    }
+    handedOff_.add(n);
+  }
+  for (size_t i = 0; i < shm.size(); ++i)
+  {
+    closeChannel(loop, shm[i]);
+  }
+
+  if (!loop->channels.empty() && monotonicSeconds() >= loop->drainDeadline)
+  {
+    std::vector<RpcChannel*> busy;
+    for (std::map<RpcChannel*, int>::iterator it = loop->channels.begin();
+         it != loop->channels.end(); ++it)
+    {
+      busy.push_back(it->first);
+    }
+    for (size_t i = 0; i < busy.size(); ++i)
+    {
+      closeChannel(loop, busy[i]);
+    }
+  }
+
+  if (loop->channels.empty())
+  {
+    ::close(loop->successor);
+    loop->successor = -1;
+    if (drainingLoops_.addAndGet(-1) == 0)
+    {
+      event_active(drainedTimer_, EV_TIMEOUT, 0);
+    }
+  }
+  else
+  {
+    struct timeval tv = { 0, 50 * 1000 };
+    evtimer_add(loop->drainTimer, &tv);
+  }
+}
+
+// In the loop thread, the hand-off is called off.
+void RpcServer::undrain(Loop* loop)
+{
+  for (std::map<RpcChannel*, int>::iterator it = loop->channels.begin();
+       it != loop->channels.end(); ++it)
+  {
+    it->first->resumeReading();
+  }
+  if (loop->drainTimer)
+  {
+    event_free(loop->drainTimer);
+    loop->drainTimer = NULL;
+  }
+  if (loop->successor >= 0)
+  {
+    ::close(loop->successor);
+    loop->successor = -1;
+  }
+}
+
+void RpcServer::onConnect(evutil_socket_t fd, size_t ringBytes)
+{
+  if (holding_)
+  {
+    held_.push_back(std::make_pair(static_cast<int>(fd), ringBytes));
+    return;
+  }
+  Loop* loop = loops_[currLoop_];
   ++currLoop_;
   if (static_cast<size_t>(currLoop_) >= loops_.size())
   {
     currLoop_ = 0;
   }
 
-  RpcChannel* channel = new RpcChannel(base, fd, services_);
-  channel->setDisconnectCb(& RpcServer::disconnectCallback, this);
+  // the channel is created in its loop, which alone touches loop->channels
+  NewChannel* arg = new NewChannel;
+  arg->loop = loop;
+  arg->fd = fd;
+  arg->ringBytes = ringBytes;
+  event_base_once(loop->base, -1, EV_TIMEOUT, newChannelCallback, arg, NULL);
+}
 
-  muduo::MutexLockGuard lock(mutex_);
-  channels_.insert(channel);
+void RpcServer::onNewChannel(Loop* loop, evutil_socket_t fd, size_t ringBytes)
+{
+  RpcChannel* channel = NULL;
+  if (ringBytes > 0)
+  {
+    ShmPipe* pipe = ShmPipe::accept(loop->base, fd, ringBytes);
+    if (pipe == NULL)
+    {
+      return;
+    }
+    channel = new RpcChannel(pipe, services_);
+  }
+  else
+  {
+    channel = new RpcChannel(loop->base, fd, services_);
+  }
+  channel->setDisconnectCb(& RpcServer::disconnectCallback, loop);
+  channel->setBufferedBytesCounter(&loop->bufferedBytes);
+  if (sliceBytes_ > 0)
+  {
+    channel->setSliceBytes(sliceBytes_);
+  }
+  if (budgetFrames_ > 0 || budgetMicros_ > 0)
+  {
+    // stats cost two clock reads per callback, only pay them with a budget
+    channel->setReadBudget(budgetFrames_, budgetMicros_);
+    channel->setReadStats(&loop->readStats);
+  }
+  channel->setResponseCache(responseCache_);
+  numConnections_.increment();
+
+  int slot = -1;
+  if (!loop->wheel.empty())
+  {
+    slot = static_cast<int>((channel->lastActive() + idleTimeout_) % loop->wheel.size());
+    loop->wheel[slot].insert(channel);
+  }
+  loop->channels[channel] = slot;
+}
+
+void RpcServer::onDisconnect(Loop* loop, RpcChannel* channel)
+{
+  closeChannel(loop, channel);
+}
+
+void RpcServer::closeChannel(Loop* loop, RpcChannel* channel)
+{
+  std::map<RpcChannel*, int>::iterator it = loop->channels.find(channel);
+  assert(it != loop->channels.end());
+  if (it->second >= 0)
+  {
+    loop->wheel[it->second].erase(channel);
+  }
+  loop->channels.erase(it);
+  numConnections_.decrement();
+  channel->close();
+}
+
+void RpcServer::onTimer(Loop* loop)
+{
+  const time_t now = monotonicSeconds();
+  if (!loop->wheel.empty())
+  {
+    // catch up on ticks missed by a busy loop, each slot once at most
+    const time_t size = loop->wheel.size();
+    time_t tick = std::max(loop->lastTick + 1, now - size + 1);
+    for (; tick <= now; ++tick)
+    {
+      reapIdle(loop, static_cast<int>(tick % size), now);
+    }
+  }
+  loop->lastTick = now;
+
+  if (memoryBudget_ > 0)
+  {
+    enforceBudget(loop);
+  }
 }
 
-void RpcServer::onDisconnect(RpcChannel* channel)
+void RpcServer::reapIdle(Loop* loop, int slot, time_t now)
 {
+  std::set<RpcChannel*> due;
+  due.swap(loop->wheel[slot]);
+  for (std::set<RpcChannel*>::iterator it = due.begin(); it != due.end(); ++it)
   {
-  muduo::MutexLockGuard lock(mutex_);
-  int n = channels_.erase(channel);
-  assert(n == 1);
+    RpcChannel* channel = *it;
+    time_t deadline = channel->lastActive() + idleTimeout_;
+    if (deadline <= now)
+    {
+      if (channel->pendingRequests() == 0)
+      {
+        loop->channels[channel] = -1;  // out of the wheel already
+        closeChannel(loop, channel);
+        idleClosed_.increment();
+        continue;
+      }
+      // look again in a second
+      deadline = now + 1;
+    }
+    int next = static_cast<int>(deadline % loop->wheel.size());
+    loop->wheel[next].insert(channel);
+    loop->channels[channel] = next;
+  }
+}
+
+void RpcServer::enforceBudget(Loop* loop)
+{
+  const int64_t usage = memoryUsage();
+  if (usage <= memoryBudget_)
+  {
+    return;
+  }
+
+  // a loop over its fair share of the budget frees what it holds beyond it,
+  // so the other loops keep their connections
+  const int64_t mine = loop->bufferedBytes.get()
+      + static_cast<int64_t>(loop->channels.size()) * kConnectionCharge;
+  int64_t excess = std::min(mine - memoryBudget_ / static_cast<int64_t>(loops_.size()),
+                            usage - memoryBudget_);
+
+  std::vector<Victim> victims;
+  for (std::map<RpcChannel*, int>::iterator it = loop->channels.begin();
+       it != loop->channels.end(); ++it)
+  {
+    RpcChannel* channel = it->first;
+    if (channel->pendingRequests() == 0)
+    {
+      Victim victim = { channel,
+                        static_cast<int64_t>(channel->inputBytes() + channel->outputBytes())
+                          + kConnectionCharge,
+                        channel->lastActive() };
+      victims.push_back(victim);
+    }
+  }
+  std::sort(victims.begin(), victims.end());
+  for (size_t i = 0; i < victims.size() && excess > 0; ++i)
+  {
+    excess -= victims[i].bytes;
+    closeChannel(loop, victims[i].channel);
+    budgetClosed_.increment();
   }
-  delete channel;
 }
 
 void RpcServer::newConnectionCallback(struct evconnlistener* listener,
@@ -112,12 +911,91 @@ void RpcServer::newConnectionCallback(struct evconnlistener* listener,
   printf("newConnectionCallback\n");
   RpcServer* self = static_cast<RpcServer*>(ctx);
   assert(self->evListener_ == listener);
-  self->onConnect(fd);
+  self->onConnect(fd, 0);
+}
+
+void RpcServer::newShmConnectionCallback(struct evconnlistener* listener,
+      evutil_socket_t fd, struct sockaddr* address, int socklen, void* ctx)
+{
+  RpcServer* self = static_cast<RpcServer*>(ctx);
+  assert(self->shmListener_ == listener);
+  self->onConnect(fd, self->shmRingBytes_);
+}
+
+void RpcServer::newChannelCallback(evutil_socket_t, short, void* ptr)
+{
+  NewChannel* arg = static_cast<NewChannel*>(ptr);
+  Loop* loop = static_cast<Loop*>(arg->loop);
+  loop->server->onNewChannel(loop, arg->fd, arg->ringBytes);
+  delete arg;
 }
 
 void RpcServer::disconnectCallback(RpcChannel* channel, void* ctx)
 {
   printf("disconnectCallback\n");
-  RpcServer* self = static_cast<RpcServer*>(ctx);
-  self->onDisconnect(channel);
+  Loop* loop = static_cast<Loop*>(ctx);
+  loop->server->onDisconnect(loop, channel);
+}
+
+void RpcServer::successorCallback(evutil_socket_t, short, void* ptr)
+{
+  RpcServer* self = static_cast<RpcServer*>(ptr);
+  self->onSuccessor();
+}
+
+void RpcServer::successorLostCallback(evutil_socket_t, short, void* ptr)
+{
+  RpcServer* self = static_cast<RpcServer*>(ptr);
+  self->onSuccessorLost();
+}
+
+void RpcServer::drainCallback(evutil_socket_t, short, void* ptr)
+{
+  Loop* loop = static_cast<Loop*>(ptr);
+  loop->server->drain(loop);
+}
+
+void RpcServer::undrainCallback(evutil_socket_t, short, void* ptr)
+{
+  Loop* loop = static_cast<Loop*>(ptr);
+  loop->server->undrain(loop);
+}
+
+void RpcServer::drainedCallback(evutil_socket_t, short, void* ptr)
+{
+  RpcServer* self = static_cast<RpcServer*>(ptr);
+  if (self->successor_ < 0)
+  {
+    // the successor is gone, we serve on
+    return;
+  }
+  if (self->drainingLoops_.get() == 0)
+  {
+    // every loop is done serving, not just out of time, so the successor
+    // may go on before we exit
+    if (self->release_)
+    {
+      self->release_(self->handOffArg_);
+    }
+    RestartHeader header = { kRestartMagic, kReleased };
+    sockets::sendFds(self->successor_, &header, sizeof header, NULL, 0);
+  }
+  for (size_t i = 0; i < self->loops_.size(); ++i)
+  {
+    event_base_loopexit(self->loops_[i]->base, NULL);
+  }
+  // not one of loops_ with threads, and successorEvent_ keeps it going
+  event_base_loopexit(self->base_, NULL);
+}
+
+void RpcServer::predecessorCallback(evutil_socket_t, short, void* ptr)
+{
+  RpcServer* self = static_cast<RpcServer*>(ptr);
+  self->onPredecessor();
+}
+
+void RpcServer::timerCallback(evutil_socket_t, short, void* ptr)
+{
+  Loop* loop = static_cast<Loop*>(ptr);
+  loop->server->onTimer(loop);
 }
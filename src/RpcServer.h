@@ -13,7 +13,10 @@
 #include <event2/listener.h>
 #include <google/protobuf/service.h>
 
-#include "muduo/Mutex.h"
+#include "RpcChannel.h"
+#include "muduo/Atomic.h"
+
+#include <time.h>
 
 #include <map>
 #include <set>
@@ -24,6 +27,7 @@ namespace evproto
 {
 
 class EventLoop;
+class ResponseCache;
 class RpcChannel;
 
 namespace gpb = ::google::protobuf;
@@ -31,29 +35,162 @@ namespace gpb = ::google::protobuf;
 class RpcServer
 {
  public:
+  typedef void (*handoff_cb)(void* arg);
+
   RpcServer(EventLoop* loop, int port);
+  // Hot restart. If a server process listens at restartPath, takes over
+  // from it: serves its listening socket and idle connections as they
+  // come, see setHandOffCallbacks(), and binds port itself only if it
+  // exits without handing over the listener. Else listens on port. Once
+  // the predecessor has exited, listens at restartPath for its own
+  // successor: once one connects, stops accepting, hands over each
+  // connection as soon as it is idle, closes those still busy after the
+  // drain timeout, and exits loop. If the successor goes away before
+  // that, accepts again and waits for the next one.
+  RpcServer(EventLoop* loop, int port, const std::string& restartPath);
   ~RpcServer();
 
+  // Hot restart, for services that need something only one process can
+  // hold, eg. a database lock. acquire(arg) runs once this server may take
+  // it: now if there is no predecessor, else in the loop thread once the
+  // predecessor has served its last request and run release(arg), or has
+  // exited. Until then connections are taken over and accepted, but their
+  // requests wait; for as long as the busiest connection of the
+  // predecessor takes to go idle, its drain timeout at most.
+  // Call before loop.loop().
+  void setHandOffCallbacks(handoff_cb acquire, handoff_cb release, void* arg);
+
   void setThreadNum(int numThreads);
+  // Closes a connection that has read nothing and has no request in
+  // service for this many seconds, 0 for never (default).
+  // Call before the first connection.
+  void setIdleTimeout(int seconds);
+  // Once the buffered bytes of all connections plus kConnectionCharge each
+  // exceed this, closes connections with no request in service, the
+  // largest first, then the longest idle. 0 for no limit (default).
+  void setMemoryBudget(int64_t bytes);
+  // For a hand-off to a successor, 10 by default.
+  void setDrainTimeout(int seconds) { drainSeconds_ = seconds; }
+  // RpcChannel::setSliceBytes() of every connection.
+  void setSliceBytes(size_t bytes) { sliceBytes_ = bytes; }
+  // Reuses the responses of methods with the (evproto.cache_ttl_ms)
+  // option, or given to cacheResponses(), for identical request bytes.
+  // Keeps up to bytes of them. Call before start serving.
+  void setResponseCache(size_t bytes);
+  void cacheResponses(const gpb::MethodDescriptor* method, int millis);
+  const ResponseCache* responseCache() const { return responseCache_; }
+  // RpcChannel::setReadBudget() of every connection, which also counts
+  // readStats(); without a budget they stay zero.
+  void setReadBudget(int frames, int micros) { budgetFrames_ = frames; budgetMicros_ = micros; }
   void registerService(gpb::Service*);
+  // Also serves clients on this host through shared memory rings of
+  // ringBytes each way, see ShmPipe. They connect an RpcChannel to path.
+  void listenShm(const std::string& path, size_t ringBytes = 1024 * 1024);
   void start();
 
+  int64_t memoryUsage() const;
+  int numConnections() const { return numConnections_.get(); }
+  int64_t idleClosed() const { return idleClosed_.get(); }
+  int64_t budgetClosed() const { return budgetClosed_.get(); }
+  int64_t handedOff() const { return handedOff_.get(); }
+  size_t numLoops() const { return loops_.size(); }
+  const ReadStats& readStats(size_t loop) const { return loops_[loop]->readStats; }
+
+  // RpcChannel, bufferevent and libevent bookkeeping, roughly
+  static const int64_t kConnectionCharge = 2048;
+
  private:
+  // Connections of one event_base, only touched in its thread.
+  struct Loop
+  {
+    RpcServer* server;
+    struct event_base* base;
+    struct event* timer;
+    time_t lastTick;
+    struct event* drainTimer;   // handing off to a successor
+    time_t drainDeadline;
+    int successor;              // this loop's dup of RpcServer::successor_
+    muduo::AtomicInt64 bufferedBytes;
+    ReadStats readStats;
+    std::map<RpcChannel*, int> channels;         // to the slot in wheel
+    std::vector<std::set<RpcChannel*> > wheel;   // by idle deadline % wheel.size()
+  };
+
   static void newConnectionCallback(struct evconnlistener* listener,
       evutil_socket_t fd, struct sockaddr* address, int socklen, void* ctx);
+  static void newShmConnectionCallback(struct evconnlistener* listener,
+      evutil_socket_t fd, struct sockaddr* address, int socklen, void* ctx);
+  static void newChannelCallback(evutil_socket_t, short, void* ptr);
   static void disconnectCallback(RpcChannel*, void* ctx);
+  static void timerCallback(evutil_socket_t, short, void* ptr);
+  static void successorCallback(evutil_socket_t, short, void* ptr);
+  static void successorLostCallback(evutil_socket_t, short, void* ptr);
+  static void drainCallback(evutil_socket_t, short, void* ptr);
+  static void undrainCallback(evutil_socket_t, short, void* ptr);
+  static void drainedCallback(evutil_socket_t, short, void* ptr);
+  static void predecessorCallback(evutil_socket_t, short, void* ptr);
   static void* runLoop(void* ptr);
 
-  void onConnect(evutil_socket_t fd);
-  void onDisconnect(RpcChannel*);
-
+  Loop* newLoop(struct event_base* base);
+  void startTimers();
+  void onConnect(evutil_socket_t fd, size_t ringBytes);
+  void onNewChannel(Loop* loop, evutil_socket_t fd, size_t ringBytes);
+  void onDisconnect(Loop* loop, RpcChannel*);
+  void onTimer(Loop* loop);
+  void cacheByOptions(gpb::Service* service);
+  void listenPort();
+  bool takeOver(const std::string& path);
+  bool receiveHandOff();
+  void onPredecessor();
+  void acquire();
+  void tookOver();
+  void listenRestart(const std::string& path);
+  void onSuccessor();
+  void onSuccessorLost();
+  void drain(Loop* loop);
+  void undrain(Loop* loop);
+  void reapIdle(Loop* loop, int slot, time_t now);
+  void enforceBudget(Loop* loop);
+  void closeChannel(Loop* loop, RpcChannel*);
+
+  struct event_base* base_;
   struct evconnlistener* evListener_;
-  std::vector<struct event_base*> loops_;
+  struct evconnlistener* shmListener_;
+  std::string shmPath_;
+  size_t shmRingBytes_;
+  std::vector<Loop*> loops_;
   int currLoop_;
   std::map<std::string, gpb::Service*> services_;
-
-  muduo::MutexLock mutex_;
-  std::set<RpcChannel*> channels_;
+  int idleTimeout_;
+  int64_t memoryBudget_;
+  size_t sliceBytes_;
+  int budgetFrames_;
+  int budgetMicros_;
+  ResponseCache* responseCache_;
+
+  std::string restartPath_;
+  int restartSock_;             // for a successor to connect
+  struct event* restartEvent_;
+  int successor_;
+  struct event* successorEvent_; // its end of stream, before we are done
+  struct event* drainedTimer_;  // keeps loop running while others drain
+  int drainSeconds_;
+  muduo::AtomicInt32 drainingLoops_;
+  int port_;
+  int predecessor_;
+  struct event* predecessorEvent_;
+  std::vector<int> adopted_;    // connections of the predecessor, to serve
+  bool released_;               // by the predecessor, before it exits
+  handoff_cb acquire_;
+  handoff_cb release_;
+  void* handOffArg_;
+  bool holding_;                // until acquire_ has run
+  std::vector<std::pair<int, size_t> > held_;  // fd and ringBytes, as onConnect()
+
+  muduo::AtomicInt32 numConnections_;
+  muduo::AtomicInt64 idleClosed_;
+  muduo::AtomicInt64 budgetClosed_;
+  muduo::AtomicInt64 handedOff_;
 };
 
 }
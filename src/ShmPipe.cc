@@ -0,0 +1,468 @@
+#include "ShmPipe.h"
+#include "SocketsOps.h"
+
+#include <event2/buffer.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#if LIBEVENT_VERSION_NUMBER < 0x02010100
+#error "ShmPipe needs bufferevent_trigger_event() of Libevent 2.1.1 or later."
+#endif
+
+using namespace evproto;
+
+// One direction. head and tail only grow, head - tail bytes are in use.
+struct ShmPipe::Ring
+{
+  uint64_t head;              // written by the producer
+  char pad0[56];
+  uint64_t tail;              // written by the consumer
+  char pad1[56];
+  int32_t consumerWaiting;    // asleep for bytes
+  char pad2[60];
+  int32_t producerWaiting;    // asleep for room
+  char pad3[60];
+};
+
+namespace
+{
+
+const uint32_t kMagic = 0x53484d30;  // "SHM0"
+
+// sent with the memory, the server's eventfd and the client's eventfd
+struct Hello
+{
+  uint32_t magic;
+  uint32_t ringBytes;
+};
+
+const int kNumFds = 3;
+
+// the producer publishes head, then reads consumerWaiting; the consumer
+// sets consumerWaiting, then reads head. With a full fence between each
+// pair, one of them sees the other, so no wakeup is lost.
+void fence()
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+uint64_t loadAcquire(const uint64_t* p)
+{
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+void storeRelease(uint64_t* p, uint64_t value)
+{
+  __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+void setFlag(int32_t* p, int32_t value)
+{
+  __atomic_store_n(p, value, __ATOMIC_RELAXED);
+}
+
+int32_t getFlag(const int32_t* p)
+{
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+size_t roundUpPowerOf2(size_t n)
+{
+  size_t power = 4096;
+  while (power < n)
+  {
+    power *= 2;
+  }
+  return power;
+}
+
+}
+
+ShmPipe::ShmPipe(struct event_base* base, int sock)
+  : base_(base),
+    sock_(sock),
+    sockEvent_(NULL),
+    wakeup_(NULL),
+    connected_(false),
+    memory_(MAP_FAILED),
+    mapBytes_(0),
+    ringBytes_(0),
+    rx_(NULL),
+    tx_(NULL),
+    rxData_(NULL),
+    txData_(NULL),
+    txHead_(0),
+    rxTail_(0),
+    broken_(false),
+    efd_(-1),
+    peerEfd_(-1)
+{
+  // both ends share a lock; deferred callbacks keep the pumps and the
+  // channel from calling into each other
+  bufferevent_pair_new(base, BEV_OPT_THREADSAFE | BEV_OPT_DEFER_CALLBACKS, pair_);
+}
+
+ShmPipe::ShmPipe(struct event_base* base, const std::string& path)
+  : base_(base),
+    sock_(::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)),
+    sockEvent_(NULL),
+    wakeup_(NULL),
+    connected_(false),
+    memory_(MAP_FAILED),
+    mapBytes_(0),
+    ringBytes_(0),
+    rx_(NULL),
+    tx_(NULL),
+    rxData_(NULL),
+    txData_(NULL),
+    txHead_(0),
+    rxTail_(0),
+    broken_(false),
+    efd_(-1),
+    peerEfd_(-1)
+{
+  bufferevent_pair_new(base, BEV_OPT_THREADSAFE | BEV_OPT_DEFER_CALLBACKS, pair_);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+  if (sock_ >= 0 && path.size() < sizeof addr.sun_path
+      && ::connect(sock_, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) == 0)
+  {
+    sockEvent_ = event_new(base_, sock_, EV_READ | EV_PERSIST, sockCallback, this);
+    event_add(sockEvent_, NULL);
+  }
+  else
+  {
+    // the channel sets its callbacks after this returns, report from the loop
+    sockEvent_ = event_new(base_, -1, 0, sockCallback, this);
+    event_active(sockEvent_, EV_TIMEOUT, 0);
+  }
+}
+
+ShmPipe::~ShmPipe()
+{
+  if (sockEvent_)
+  {
+    event_free(sockEvent_);
+  }
+  if (wakeup_)
+  {
+    event_free(wakeup_);
+  }
+  bufferevent_free(pair_[1]);
+  if (memory_ != MAP_FAILED)
+  {
+    ::munmap(memory_, mapBytes_);
+  }
+  if (efd_ >= 0)
+  {
+    ::close(efd_);
+  }
+  if (peerEfd_ >= 0)
+  {
+    ::close(peerEfd_);
+  }
+  if (sock_ >= 0)
+  {
+    ::close(sock_);
+  }
+}
+
+ShmPipe* ShmPipe::accept(struct event_base* base, int sock, size_t ringBytes)
+{
+  ShmPipe* pipe = new ShmPipe(base, sock);
+  if (!pipe->create(roundUpPowerOf2(ringBytes)))
+  {
+    delete pipe;
+    return NULL;
+  }
+  return pipe;
+}
+
+bool ShmPipe::create(size_t ringBytes)
+{
+  const size_t mapBytes = 2 * sizeof(Ring) + 2 * ringBytes;
+  int fds[kNumFds] = { ::memfd_create("evproto-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING),
+                       ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+                       ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) };
+  void* memory = MAP_FAILED;
+  if (fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0
+      && ::ftruncate(fds[0], static_cast<off_t>(mapBytes)) == 0
+      // a client that shrank it would have us die of SIGBUS
+      && ::fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0)
+  {
+    memory = ::mmap(NULL, mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  }
+  if (memory == MAP_FAILED)
+  {
+    for (int i = 0; i < kNumFds; ++i)
+    {
+      if (fds[i] >= 0)
+      {
+        ::close(fds[i]);
+      }
+    }
+    return false;
+  }
+
+  // ready to read before the client can write
+  mapBytes_ = mapBytes;
+  setUp(memory, ringBytes, fds[1], fds[2], true);
+  Hello hello = { kMagic, static_cast<uint32_t>(ringBytes) };
+  bool sent = sockets::sendFds(sock_, &hello, sizeof hello, fds, kNumFds);
+  ::close(fds[0]);
+  if (!sent)
+  {
+    return false;
+  }
+  connected_ = true;
+  sockEvent_ = event_new(base_, sock_, EV_READ | EV_PERSIST, sockCallback, this);
+  event_add(sockEvent_, NULL);
+  return true;
+}
+
+void ShmPipe::onHello()
+{
+  Hello hello;
+  int fds[kNumFds];
+  int received = sockets::recvFds(sock_, &hello, sizeof hello, fds, kNumFds);
+  if (received != kNumFds || hello.magic != kMagic
+      || hello.ringBytes == 0 || (hello.ringBytes & (hello.ringBytes - 1)) != 0)
+  {
+    for (int i = 0; i < received; ++i)
+    {
+      ::close(fds[i]);
+    }
+    fail(BEV_EVENT_ERROR);
+    return;
+  }
+  const size_t mapBytes = 2 * sizeof(Ring) + 2 * static_cast<size_t>(hello.ringBytes);
+  void* memory = ::mmap(NULL, mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  ::close(fds[0]);
+  if (memory == MAP_FAILED)
+  {
+    ::close(fds[1]);
+    ::close(fds[2]);
+    fail(BEV_EVENT_ERROR);
+    return;
+  }
+  mapBytes_ = mapBytes;
+  setUp(memory, hello.ringBytes, fds[2], fds[1], false);
+  connected_ = true;
+  bufferevent_trigger_event(pair_[0], BEV_EVENT_CONNECTED, 0);
+}
+
+// ring 0 carries client to server, ring 1 server to client
+void ShmPipe::setUp(void* memory, size_t ringBytes, int efd, int peerEfd, bool server)
+{
+  memory_ = memory;
+  ringBytes_ = ringBytes;
+  efd_ = efd;
+  peerEfd_ = peerEfd;
+  Ring* rings = static_cast<Ring*>(memory);
+  char* data = static_cast<char*>(memory) + 2 * sizeof(Ring);
+  rx_ = &rings[server ? 0 : 1];
+  tx_ = &rings[server ? 1 : 0];
+  rxData_ = data + (server ? 0 : ringBytes);
+  txData_ = data + (server ? ringBytes : 0);
+
+  wakeup_ = event_new(base_, efd_, EV_READ | EV_PERSIST, wakeupCallback, this);
+  event_add(wakeup_, NULL);
+  // the channel's output waits in its own buffer once a ring's worth is
+  // queued here, so RpcChannel::setSliceBytes() still sees back pressure
+  bufferevent_setwatermark(pair_[1], EV_READ, 0, ringBytes_);
+  bufferevent_setcb(pair_[1], readCallback, NULL, NULL, this);
+  bufferevent_enable(pair_[1], EV_READ | EV_WRITE);
+
+  bufferevent_lock(pair_[1]);
+  pumpRx();
+  bufferevent_unlock(pair_[1]);
+}
+
+// Moves what the channel wrote into the tx ring, as much as fits.
+// Called with pair_ locked.
+void ShmPipe::pumpTx()
+{
+  struct evbuffer* input = bufferevent_get_input(pair_[1]);
+  bool published = false;
+  size_t len = 0;
+  while (!broken_ && (len = evbuffer_get_length(input)) > 0)
+  {
+    const uint64_t head = txHead_;
+    uint64_t tail = loadAcquire(&tx_->tail);
+    if (corrupt(head, tail))
+    {
+      return;
+    }
+    size_t room = ringBytes_ - static_cast<size_t>(head - tail);
+    if (room == 0)
+    {
+      setFlag(&tx_->producerWaiting, 1);
+      fence();
+      // the consumer may have made room before it saw the flag
+      tail = loadAcquire(&tx_->tail);
+      if (corrupt(head, tail) || head - tail == ringBytes_)
+      {
+        break;
+      }
+      setFlag(&tx_->producerWaiting, 0);
+      continue;
+    }
+    const size_t n = std::min(len, room);
+    const size_t offset = static_cast<size_t>(head) & (ringBytes_ - 1);
+    const size_t first = std::min(n, ringBytes_ - offset);
+    evbuffer_remove(input, txData_ + offset, first);
+    if (n > first)
+    {
+      evbuffer_remove(input, txData_, n - first);
+    }
+    txHead_ = head + n;
+    storeRelease(&tx_->head, txHead_);
+    published = true;
+  }
+
+  if (published)
+  {
+    fence();
+    if (getFlag(&tx_->consumerWaiting))
+    {
+      notify();
+    }
+  }
+}
+
+// Moves everything in the rx ring to the channel, then marks this side
+// asleep. Called with pair_ locked.
+void ShmPipe::pumpRx()
+{
+  struct evbuffer* output = bufferevent_get_output(pair_[1]);
+  bool consumed = false;
+  while (!broken_)
+  {
+    const uint64_t tail = rxTail_;
+    uint64_t head = loadAcquire(&rx_->head);
+    if (corrupt(head, tail))
+    {
+      return;
+    }
+    if (head == tail)
+    {
+      setFlag(&rx_->consumerWaiting, 1);
+      fence();
+      // the producer may have published before it saw the flag
+      head = loadAcquire(&rx_->head);
+      if (head == tail)
+      {
+        break;
+      }
+      setFlag(&rx_->consumerWaiting, 0);
+      continue;
+    }
+    const size_t n = static_cast<size_t>(head - tail);
+    const size_t offset = static_cast<size_t>(tail) & (ringBytes_ - 1);
+    const size_t first = std::min(n, ringBytes_ - offset);
+    evbuffer_add(output, rxData_ + offset, first);
+    if (n > first)
+    {
+      evbuffer_add(output, rxData_, n - first);
+    }
+    rxTail_ = tail + n;
+    storeRelease(&rx_->tail, rxTail_);
+    consumed = true;
+  }
+
+  if (consumed)
+  {
+    fence();
+    if (getFlag(&rx_->producerWaiting))
+    {
+      notify();
+    }
+  }
+}
+
+// The peer's index, checked against ours before it sizes a copy.
+bool ShmPipe::corrupt(uint64_t head, uint64_t tail)
+{
+  if (head - tail <= ringBytes_)
+  {
+    return false;
+  }
+  broken_ = true;
+  fail(BEV_EVENT_ERROR);
+  return true;
+}
+
+void ShmPipe::notify()
+{
+  uint64_t one = 1;
+  ssize_t n = ::write(peerEfd_, &one, sizeof one);
+  (void)n;
+}
+
+void ShmPipe::fail(short what)
+{
+  if (sockEvent_)
+  {
+    event_del(sockEvent_);
+  }
+  if (wakeup_)
+  {
+    event_del(wakeup_);
+  }
+  bufferevent_trigger_event(pair_[0], what, 0);
+}
+
+void ShmPipe::readCallback(struct bufferevent* bev, void* ptr)
+{
+  ShmPipe* self = static_cast<ShmPipe*>(ptr);
+  assert(self->pair_[1] == bev);
+  // called with bev locked
+  self->pumpTx();
+}
+
+void ShmPipe::wakeupCallback(evutil_socket_t fd, short, void* ptr)
+{
+  ShmPipe* self = static_cast<ShmPipe*>(ptr);
+  uint64_t count = 0;
+  ssize_t n = ::read(fd, &count, sizeof count);
+  (void)n;
+  bufferevent_lock(self->pair_[1]);
+  setFlag(&self->rx_->consumerWaiting, 0);
+  setFlag(&self->tx_->producerWaiting, 0);
+  self->pumpRx();
+  self->pumpTx();
+  bufferevent_unlock(self->pair_[1]);
+}
+
+void ShmPipe::sockCallback(evutil_socket_t, short events, void* ptr)
+{
+  ShmPipe* self = static_cast<ShmPipe*>(ptr);
+  if (events & EV_TIMEOUT)
+  {
+    self->fail(BEV_EVENT_ERROR);
+    return;
+  }
+  if (!self->connected_)
+  {
+    self->onHello();
+    return;
+  }
+  // the peer never writes after the hello, this is it going away;
+  // deliver what it left in the ring first
+  bufferevent_lock(self->pair_[1]);
+  self->pumpRx();
+  bufferevent_unlock(self->pair_[1]);
+  self->fail(BEV_EVENT_EOF);
+}
@@ -0,0 +1,96 @@
+// Copyright 2010, Shuo Chen.  All rights reserved.
+// http://code.google.com/p/evproto2
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+// Author: Shuo Chen (chenshuo at chenshuo dot com)
+//
+
+#ifndef EVPROTO2_SHMPIPE_H
+#define EVPROTO2_SHMPIPE_H
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace evproto
+{
+
+// A byte stream between two processes of one host, through a pair of
+// single producer single consumer rings in shared memory. Its near end is
+// a bufferevent, so RpcChannel runs the same codec on it as on a socket.
+//
+// A side sleeps on its eventfd when its rx ring is empty or its tx ring is
+// full, and only then does the peer write that eventfd; a side busy in its
+// loop is never woken.
+//
+// The server creates the memory and both eventfds and passes them to the
+// client over a connected Unix socket, which stays open so that either
+// side sees the other go.
+class ShmPipe // : boost::noncopyable
+{
+ public:
+  // Client side, connects to an RpcServer::listenShm() path. The
+  // bufferevent reports BEV_EVENT_CONNECTED, or BEV_EVENT_ERROR.
+  ShmPipe(struct event_base* base, const std::string& path);
+  ~ShmPipe();
+
+  // Server side, hands rings of ringBytes each to the client on the
+  // accepted sock, which this owns from now on. NULL on failure.
+  static ShmPipe* accept(struct event_base* base, int sock, size_t ringBytes);
+
+  // The near end, for one RpcChannel, which frees it before deleting this.
+  struct bufferevent* bufferevent() const { return pair_[0]; }
+
+ private:
+  struct Ring;
+
+  ShmPipe(struct event_base* base, int sock);
+
+  bool create(size_t ringBytes);
+  void onHello();
+  void setUp(void* memory, size_t ringBytes, int efd, int peerEfd, bool server);
+  void pumpTx();
+  void pumpRx();
+  bool corrupt(uint64_t head, uint64_t tail);
+  void notify();
+  void fail(short what);
+
+  static void readCallback(struct bufferevent* bev, void* ptr);
+  static void wakeupCallback(evutil_socket_t, short, void* ptr);
+  static void sockCallback(evutil_socket_t, short, void* ptr);
+
+  struct event_base* base_;
+  int sock_;
+  struct bufferevent* pair_[2];   // [1] is pumped to and from the rings
+  struct event* sockEvent_;       // hello, then the peer closing
+  struct event* wakeup_;
+  bool connected_;
+
+  void* memory_;
+  size_t mapBytes_;
+  size_t ringBytes_;              // a power of 2
+  Ring* rx_;
+  Ring* tx_;
+  char* rxData_;
+  char* txData_;
+  // ours alone, the copies in the rings are the peer's to read, and may
+  // have been scribbled over
+  uint64_t txHead_;
+  uint64_t rxTail_;
+  bool broken_;
+  int efd_;                       // we sleep on
+  int peerEfd_;                   // the peer sleeps on
+
+  void operator=(const ShmPipe&);
+  ShmPipe(const ShmPipe&);
+};
+
+}
+
+#endif  // EVPROTO2_SHMPIPE_H
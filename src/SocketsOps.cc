@@ -0,0 +1,79 @@
+#include "SocketsOps.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <vector>
+
+using namespace evproto;
+
+bool sockets::sendFds(int sock, const void* data, size_t len, const int* fds, int numFds)
+{
+  struct iovec iov = { const_cast<void*>(data), len };
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * numFds));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (numFds > 0)
+  {
+    msg.msg_control = &control[0];
+    msg.msg_controllen = control.size();
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * numFds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * numFds);
+  }
+  return ::sendmsg(sock, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(len);
+}
+
+int sockets::recvFds(int sock, void* data, size_t len, int* fds, int maxFds)
+{
+  struct iovec iov = { data, len };
+  // room for more than asked for, so extra ones are closed, not dropped open
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * (maxFds + 16)));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = &control[0];
+  msg.msg_controllen = control.size();
+  ssize_t n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  if (n <= 0)
+  {
+    if (n == 0)
+    {
+      errno = 0;
+    }
+    return -1;
+  }
+
+  std::vector<int> received;
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+  {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+      const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      const int* p = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+      received.insert(received.end(), p, p + count);
+    }
+  }
+  if (n != static_cast<ssize_t>(len) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+      || received.size() > static_cast<size_t>(maxFds))
+  {
+    for (size_t i = 0; i < received.size(); ++i)
+    {
+      ::close(received[i]);
+    }
+    errno = EPROTO;
+    return -1;
+  }
+  if (!received.empty())
+  {
+    memcpy(fds, &received[0], sizeof(int) * received.size());
+  }
+  return static_cast<int>(received.size());
+}
@@ -0,0 +1,34 @@
+// Copyright 2010, Shuo Chen.  All rights reserved.
+// http://code.google.com/p/evproto2
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+
+// Author: Shuo Chen (chenshuo at chenshuo dot com)
+//
+
+#ifndef EVPROTO2_SOCKETSOPS_H
+#define EVPROTO2_SOCKETSOPS_H
+
+#include <stddef.h>
+
+namespace evproto
+{
+namespace sockets
+{
+
+// Passing descriptors over a Unix socket, SCM_RIGHTS.
+
+// Sends len bytes of data with numFds descriptors in one message.
+bool sendFds(int sock, const void* data, size_t len, const int* fds, int numFds);
+
+// Receives one message of exactly len bytes into data and up to maxFds
+// descriptors, which the caller owns. Returns the number of descriptors,
+// or -1 on error, end of stream (errno 0), or a message of another size,
+// any descriptor that came with it closed.
+int recvFds(int sock, void* data, size_t len, int* fds, int maxFds);
+
+}
+}
+
+#endif  // EVPROTO2_SOCKETSOPS_H
@@ -0,0 +1,5 @@
+# Included by the Makefiles of src, src/test and src/kvdb, so the library
+# and the programs linked to it are built with the same muduo::MutexLock.
+
+# lock contention counters in muduo::MutexLock, see muduo/MutexProfile.h
+# CXXFLAGS += -DMUDUO_MUTEX_PROFILING
@@ -0,0 +1,107 @@
+#include "GroupCommitter.h"
+
+#include <assert.h>
+
+using namespace kvdb;
+
+GroupCommitter::GroupCommitter(leveldb::DB* db, bool sync)
+  : db_(db),
+    started_(false),
+    mutex_("GroupCommitter::mutex_"),
+    cond_(mutex_),
+    running_(true)
+{
+  options_.sync = sync;
+}
+
+GroupCommitter::~GroupCommitter()
+{
+  {
+  muduo::MutexLockGuard lock(mutex_);
+  running_ = false;
+  cond_.notify();
+  }
+  if (started_)
+  {
+    pthread_join(thread_, NULL);
+  }
+  assert(queue_.empty());
+}
+
+void GroupCommitter::start()
+{
+  assert(!started_);
+  started_ = true;
+  pthread_create(&thread_, NULL, runThread, this);
+}
+
+void GroupCommitter::commit(leveldb::WriteBatch* batch,
+                            leveldb::Status* status,
+                            ::google::protobuf::Closure* done)
+{
+  Writer w = { batch, status, done };
+  muduo::MutexLockGuard lock(mutex_);
+  queue_.push_back(w);
+  if (queue_.size() == 1)
+  {
+    cond_.notify();
+  }
+}
+
+void* GroupCommitter::runThread(void* ptr)
+{
+  GroupCommitter* self = static_cast<GroupCommitter*>(ptr);
+  self->run();
+  return NULL;
+}
+
+void GroupCommitter::run()
+{
+  std::vector<Writer> writers;
+  while (true)
+  {
+    {
+    muduo::MutexLockGuard lock(mutex_);
+    while (queue_.empty() && running_)
+    {
+      cond_.wait();
+    }
+    if (queue_.empty())
+    {
+      break;
+    }
+    // whatever arrived while the previous group was syncing
+    writers.swap(queue_);
+    }
+
+    writeGroup(writers);
+    writers.clear();
+  }
+}
+
+void GroupCommitter::writeGroup(const std::vector<Writer>& writers)
+{
+  leveldb::Status status;
+  if (writers.size() == 1)
+  {
+    status = db_->Write(options_, writers[0].batch);
+  }
+  else
+  {
+    leveldb::WriteBatch group;
+    for (size_t i = 0; i < writers.size(); ++i)
+    {
+      group.Append(*writers[i].batch);
+    }
+    status = db_->Write(options_, &group);
+  }
+  numGroups_.increment();
+  numBatches_.add(writers.size());
+
+  for (size_t i = 0; i < writers.size(); ++i)
+  {
+    const Writer& w = writers[i];
+    *w.status = status;
+    w.done->Run();
+  }
+}
@@ -0,0 +1,68 @@
+#ifndef KVDB_GROUPCOMMITTER_H
+#define KVDB_GROUPCOMMITTER_H
+
+#include "../muduo/Atomic.h"
+#include "../muduo/Condition.h"
+#include "../muduo/Mutex.h"
+
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+
+#include <google/protobuf/service.h>
+
+#include <vector>
+
+namespace kvdb
+{
+
+// Merges write batches submitted concurrently from all I/O threads
+// into one leveldb::DB::Write(), i.e. one log append and one sync.
+class GroupCommitter // : boost::noncopyable
+{
+ public:
+  GroupCommitter(leveldb::DB* db, bool sync);
+  ~GroupCommitter();
+
+  void start();
+
+  // *status is set and done is run in the commit thread once the group
+  // containing batch is written, batch must stay alive until then.
+  void commit(leveldb::WriteBatch* batch,
+              leveldb::Status* status,
+              ::google::protobuf::Closure* done);
+
+  int64_t numGroups() const { return numGroups_.get(); }
+  int64_t numBatches() const { return numBatches_.get(); }
+
+ private:
+  struct Writer
+  {
+    leveldb::WriteBatch* batch;
+    leveldb::Status* status;
+    ::google::protobuf::Closure* done;
+  };
+
+  static void* runThread(void* ptr);
+  void run();
+  void writeGroup(const std::vector<Writer>& writers);
+
+  leveldb::DB* db_;
+  leveldb::WriteOptions options_;
+  pthread_t thread_;
+  bool started_;
+
+  muduo::MutexLock mutex_;
+  muduo::Condition cond_;
+  bool running_;
+  std::vector<Writer> queue_;
+
+  muduo::AtomicInt64 numGroups_;
+  muduo::AtomicInt64 numBatches_;
+
+  void operator=(const GroupCommitter&);
+  GroupCommitter(const GroupCommitter&);
+};
+
+}
+
+#endif  // KVDB_GROUPCOMMITTER_H
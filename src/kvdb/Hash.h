@@ -0,0 +1,35 @@
+#ifndef KVDB_HASH_H
+#define KVDB_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace kvdb
+{
+
+// FNV-1a, followed by the MurmurHash3 finalizer to spread the low bits.
+inline uint64_t hash64(const char* data, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; ++i)
+  {
+    h ^= static_cast<unsigned char>(data[i]);
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+inline uint64_t hash64(const std::string& str)
+{
+  return hash64(str.data(), str.size());
+}
+
+}
+
+#endif  // KVDB_HASH_H
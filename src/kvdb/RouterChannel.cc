@@ -0,0 +1,408 @@
+#include "RouterChannel.h"
+#include "Hash.h"
+#include "kvdb.pb.h"
+
+#include "../RpcChannel.h"
+#include "../RpcController.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+using namespace kvdb;
+
+RouterChannel::RouterChannel(evproto::EventLoop* loop, int virtualNodes)
+  : loop_(loop),
+    virtualNodes_(virtualNodes)
+{
+}
+
+// Calls in flight are dropped.
+RouterChannel::~RouterChannel()
+{
+  for (std::map<std::string, Node*>::iterator it = nodes_.begin();
+       it != nodes_.end();
+       ++it)
+  {
+    delete it->second->channel;
+    delete it->second;
+  }
+}
+
+void RouterChannel::addNode(const std::string& host, int port)
+{
+  char buf[32];
+  snprintf(buf, sizeof buf, ":%d", port);
+  std::string name = host + buf;
+  if (nodes_.find(name) != nodes_.end())
+  {
+    return;
+  }
+
+  Node* node = new Node;
+  node->name = name;
+  node->channel = new evproto::RpcChannel(loop_, host, port);
+  nodes_[name] = node;
+  for (int i = 0; i < virtualNodes_; ++i)
+  {
+    snprintf(buf, sizeof buf, "#%d", i);
+    // on a collision the first node keeps the point
+    ring_.insert(std::make_pair(hash64(name + buf), node));
+  }
+}
+
+void RouterChannel::removeNode(const std::string& host, int port)
+{
+  char buf[32];
+  snprintf(buf, sizeof buf, ":%d", port);
+  std::map<std::string, Node*>::iterator it = nodes_.find(host + buf);
+  if (it == nodes_.end())
+  {
+    return;
+  }
+
+  Node* node = it->second;
+  nodes_.erase(it);
+  for (std::map<uint64_t, Node*>::iterator r = ring_.begin(); r != ring_.end(); )
+  {
+    if (r->second == node)
+    {
+      ring_.erase(r++);
+    }
+    else
+    {
+      ++r;
+    }
+  }
+  // off the ring first, a failed call may be retried from its done
+  node->channel->failOutstandings("RouterChannel: " + node->name + " removed");
+  delete node->channel;
+  delete node;
+}
+
+// NULL when there is no node, eg. all were removed
+RouterChannel::Node* RouterChannel::owner(const std::string& key) const
+{
+  if (ring_.empty())
+  {
+    return NULL;
+  }
+  std::map<uint64_t, Node*>::const_iterator it = ring_.lower_bound(hash64(key));
+  if (it == ring_.end())
+  {
+    it = ring_.begin();
+  }
+  return it->second;
+}
+
+const std::string& RouterChannel::nodeOf(const std::string& key) const
+{
+  static const std::string kNone;
+  Node* node = owner(key);
+  return node ? node->name : kNone;
+}
+
+// like a channel does, response is ours to delete after done
+static void failCall(gpb::RpcController* controller, const std::string& error,
+                     gpb::Message* response, gpb::Closure* done)
+{
+  if (controller)
+  {
+    controller->SetFailed(error);
+  }
+  done->Run();
+  delete response;
+}
+
+void RouterChannel::CallMethod(const gpb::MethodDescriptor* method,
+                               gpb::RpcController* controller,
+                               const gpb::Message* request,
+                               gpb::Message* response,
+                               gpb::Closure* done)
+{
+  const gpb::Descriptor* desc = request->GetDescriptor();
+  if (desc == WriteRequest::descriptor())
+  {
+    splitWrite(method, controller, static_cast<const WriteRequest*>(request), response, done);
+  }
+  else if (desc == MultiGetRequest::descriptor())
+  {
+    splitMultiGet(method, controller, static_cast<const MultiGetRequest*>(request),
+                  response, done);
+  }
+  else if (desc == ScanRequest::descriptor() || desc == StatsRequest::descriptor())
+  {
+    broadcast(method, controller, request, response, done);
+  }
+  else
+  {
+    const gpb::FieldDescriptor* key = desc->FindFieldByName("key");
+    if (key != NULL && key->type() == gpb::FieldDescriptor::TYPE_STRING)
+    {
+      Node* node = owner(request->GetReflection()->GetString(*request, key));
+      if (node)
+      {
+        node->channel->CallMethod(method, controller, request, response, done);
+      }
+      else
+      {
+        failCall(controller, "RouterChannel: no servers", response, done);
+      }
+    }
+    else
+    {
+      // no server owns it, and all of them would answer differently
+      failCall(controller, "RouterChannel: no key to route " + method->full_name(),
+               response, done);
+    }
+  }
+}
+
+RouterChannel::SplitCall* RouterChannel::newCall(gpb::RpcController* controller,
+                                                 gpb::Message* response,
+                                                 gpb::Closure* done,
+                                                 merge_fn merge)
+{
+  SplitCall* call = new SplitCall;
+  call->controller = controller;
+  call->response = response;
+  call->done = done;
+  call->merge = merge;
+  call->remaining = 0;
+  call->limit = 0;
+  return call;
+}
+
+void RouterChannel::splitWrite(const gpb::MethodDescriptor* method,
+                               gpb::RpcController* controller,
+                               const WriteRequest* request,
+                               gpb::Message* response,
+                               gpb::Closure* done)
+{
+  if (ring_.empty())
+  {
+    failCall(controller, "RouterChannel: no servers", response, done);
+    return;
+  }
+  SplitCall* call = newCall(controller, response, done, &RouterChannel::writeDone);
+  for (int i = 0; i < request->operations_size(); ++i)
+  {
+    const WriteOperation& op = request->operations(i);
+    Part& part = call->parts[owner(op.key())];
+    if (part.request == NULL)
+    {
+      part.request = new WriteRequest;
+      part.response = new WriteResponse;
+    }
+    static_cast<WriteRequest*>(part.request)->add_operations()->CopyFrom(op);
+  }
+  static_cast<WriteResponse*>(response)->set_status(OK);
+  issue(method, call);
+}
+
+void RouterChannel::splitMultiGet(const gpb::MethodDescriptor* method,
+                                  gpb::RpcController* controller,
+                                  const MultiGetRequest* request,
+                                  gpb::Message* response,
+                                  gpb::Closure* done)
+{
+  if (ring_.empty())
+  {
+    failCall(controller, "RouterChannel: no servers", response, done);
+    return;
+  }
+  SplitCall* call = newCall(controller, response, done, &RouterChannel::multiGetDone);
+  MultiGetResponse* result = static_cast<MultiGetResponse*>(response);
+  for (int i = 0; i < request->keys_size(); ++i)
+  {
+    Part& part = call->parts[owner(request->keys(i))];
+    if (part.request == NULL)
+    {
+      part.request = new MultiGetRequest;
+      part.response = new MultiGetResponse;
+    }
+    static_cast<MultiGetRequest*>(part.request)->add_keys(request->keys(i));
+    part.indexes.push_back(i);
+    result->add_values()->set_status(NOTFOUND);
+  }
+  issue(method, call);
+}
+
+// the same request to every node
+void RouterChannel::broadcast(const gpb::MethodDescriptor* method,
+                              gpb::RpcController* controller,
+                              const gpb::Message* request,
+                              gpb::Message* response,
+                              gpb::Closure* done)
+{
+  const bool scan = request->GetDescriptor() == ScanRequest::descriptor();
+  SplitCall* call = newCall(controller, response, done,
+                            scan ? &RouterChannel::scanDone : &RouterChannel::statsDone);
+  if (scan)
+  {
+    call->limit = std::max(static_cast<const ScanRequest*>(request)->limit(), 1);
+    static_cast<ScanResponse*>(response)->set_status(OK);
+  }
+  for (std::map<std::string, Node*>::iterator it = nodes_.begin();
+       it != nodes_.end();
+       ++it)
+  {
+    Part& part = call->parts[it->second];
+    part.request = request->New();
+    part.request->CopyFrom(*request);
+    part.response = response->New();
+  }
+  issue(method, call);
+}
+
+void RouterChannel::issue(const gpb::MethodDescriptor* method, SplitCall* call)
+{
+  call->remaining = static_cast<int>(call->parts.size());
+  if (call->remaining == 0)
+  {
+    partDone(call, NULL);
+    return;
+  }
+
+  // copy, a part may complete and free call before the loop ends
+  std::vector<std::pair<Node*, Part*> > parts;
+  for (std::map<Node*, Part>::iterator it = call->parts.begin();
+       it != call->parts.end();
+       ++it)
+  {
+    parts.push_back(std::make_pair(it->first, &it->second));
+  }
+  for (size_t i = 0; i < parts.size(); ++i)
+  {
+    Part* part = parts[i].second;
+    part->node = parts[i].first;
+    part->controller = new evproto::RpcController;
+    gpb::Closure* done = gpb::NewCallback(this, &RouterChannel::partDone, call, part);
+    // the node channel deletes part->response
+    parts[i].first->channel->CallMethod(method, part->controller, part->request,
+                                        part->response, done);
+  }
+}
+
+void RouterChannel::writeDone(SplitCall* call, Part* part)
+{
+  const WriteResponse* sub = static_cast<const WriteResponse*>(part->response);
+  WriteResponse* result = static_cast<WriteResponse*>(call->response);
+  if (sub->status() != OK)
+  {
+    result->set_status(sub->status());
+  }
+}
+
+void RouterChannel::multiGetDone(SplitCall* call, Part* part)
+{
+  MultiGetResponse* sub = static_cast<MultiGetResponse*>(part->response);
+  MultiGetResponse* result = static_cast<MultiGetResponse*>(call->response);
+  for (int i = 0; i < sub->values_size() && i < static_cast<int>(part->indexes.size()); ++i)
+  {
+    result->mutable_values(part->indexes[i])->Swap(sub->mutable_values(i));
+  }
+}
+
+void RouterChannel::scanDone(SplitCall* call, Part* part)
+{
+  ScanResponse* sub = static_cast<ScanResponse*>(part->response);
+  ScanResponse* result = static_cast<ScanResponse*>(call->response);
+  if (sub->status() != OK)
+  {
+    result->set_status(sub->status());
+  }
+  for (int i = 0; i < sub->kvs_size(); ++i)
+  {
+    result->add_kvs()->Swap(sub->mutable_kvs(i));
+  }
+  if (sub->has_next_key() && (call->nextKey.empty() || sub->next_key() < call->nextKey))
+  {
+    call->nextKey = sub->next_key();
+  }
+}
+
+void RouterChannel::statsDone(SplitCall* call, Part* part)
+{
+  StatsResponse* sub = static_cast<StatsResponse*>(part->response);
+  StatsResponse* result = static_cast<StatsResponse*>(call->response);
+  for (int i = 0; i < sub->counters_size(); ++i)
+  {
+    Counter* counter = result->add_counters();
+    counter->Swap(sub->mutable_counters(i));
+    counter->set_name(part->node->name + "/" + counter->name());
+  }
+}
+
+void RouterChannel::partDone(SplitCall* call, Part* part)
+{
+  if (part)
+  {
+    if (part->controller->Failed())
+    {
+      call->error = part->controller->ErrorText();
+    }
+    else
+    {
+      (this->*call->merge)(call, part);
+    }
+    delete part->controller;
+    delete part->request;
+  }
+  if (--call->remaining <= 0)
+  {
+    if (call->merge == &RouterChannel::scanDone)
+    {
+      finishScan(call);
+    }
+    if (!call->error.empty() && call->controller)
+    {
+      call->controller->SetFailed(call->error);
+    }
+    call->done->Run();
+    delete call->response;
+    delete call;
+  }
+}
+
+static bool keyLess(const KeyValue* lhs, const KeyValue* rhs)
+{
+  return lhs->key() < rhs->key();
+}
+
+// A node stops at its next_key, past the least of them another node may
+// hold keys not seen yet, so the result ends before it.
+void RouterChannel::finishScan(SplitCall* call)
+{
+  ScanResponse* result = static_cast<ScanResponse*>(call->response);
+  std::vector<KeyValue*> kvs;
+  for (int i = 0; i < result->kvs_size(); ++i)
+  {
+    if (call->nextKey.empty() || result->kvs(i).key() < call->nextKey)
+    {
+      kvs.push_back(result->mutable_kvs(i));
+    }
+  }
+  std::sort(kvs.begin(), kvs.end(), keyLess);
+
+  std::string nextKey = call->nextKey;
+  if (static_cast<int>(kvs.size()) > call->limit)
+  {
+    nextKey = kvs[call->limit]->key();
+    kvs.resize(call->limit);
+  }
+  ScanResponse merged;
+  for (size_t i = 0; i < kvs.size(); ++i)
+  {
+    merged.add_kvs()->Swap(kvs[i]);
+  }
+  result->mutable_kvs()->Swap(merged.mutable_kvs());
+  if (nextKey.empty())
+  {
+    result->clear_next_key();
+  }
+  else
+  {
+    result->set_next_key(nextKey);
+  }
+}
@@ -0,0 +1,121 @@
+#ifndef KVDB_ROUTERCHANNEL_H
+#define KVDB_ROUTERCHANNEL_H
+
+#include <google/protobuf/service.h>
+#include <google/protobuf/descriptor.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace evproto
+{
+class EventLoop;
+class RpcChannel;
+}
+
+namespace kvdb
+{
+
+class MultiGetRequest;
+class ScanRequest;
+class WriteRequest;
+
+namespace gpb = ::google::protobuf;
+
+// Spreads LeveldbService calls over a fleet of kvdb servers by a
+// consistent hash ring of the keys, with virtualNodes points per server.
+//
+// Requests with a key field go to the owner of the key, Write and MultiGet
+// are split by owner, Scan and Stats go to every server, all in parallel.
+// Scan merges the ranges of the servers in key order, Stats names each
+// counter "host:port/name". Anything else without a key fails, so does
+// anything but Scan and Stats while there is no server.
+// Like evproto::RpcChannel, the response is deleted after done->Run(), and
+// a call fails, its controller SetFailed(), if any server it went to fails.
+// All calls must be made in the loop thread.
+class RouterChannel : public gpb::RpcChannel
+{
+ public:
+  explicit RouterChannel(evproto::EventLoop* loop, int virtualNodes = 160);
+  ~RouterChannel();
+
+  void addNode(const std::string& host, int port);
+  // Calls in flight to the node fail.
+  void removeNode(const std::string& host, int port);
+
+  // "host:port" of the server owning key, empty if there is no server
+  const std::string& nodeOf(const std::string& key) const;
+
+  void CallMethod(const gpb::MethodDescriptor* method,
+                  gpb::RpcController* controller,
+                  const gpb::Message* request,
+                  gpb::Message* response,
+                  gpb::Closure* done);
+
+ private:
+  struct Node
+  {
+    std::string name;
+    evproto::RpcChannel* channel;
+  };
+
+  struct Part;
+  struct SplitCall;
+  // folds a done part into the caller's response
+  typedef void (RouterChannel::*merge_fn)(SplitCall* call, Part* part);
+
+  // one per node taking part in a split call
+  struct Part
+  {
+    Node* node;
+    gpb::Message* request;
+    gpb::Message* response;
+    gpb::RpcController* controller;
+    std::vector<int> indexes;  // MultiGet: positions in the caller's keys
+  };
+
+  struct SplitCall
+  {
+    gpb::RpcController* controller;
+    gpb::Message* response;
+    gpb::Closure* done;
+    merge_fn merge;
+    std::map<Node*, Part> parts;
+    int remaining;
+    std::string error;
+    // Scan
+    int limit;
+    std::string nextKey;       // least next_key of the parts
+  };
+
+  Node* owner(const std::string& key) const;
+  SplitCall* newCall(gpb::RpcController* controller, gpb::Message* response,
+                     gpb::Closure* done, merge_fn merge);
+  void splitWrite(const gpb::MethodDescriptor* method, gpb::RpcController* controller,
+                  const WriteRequest* request, gpb::Message* response, gpb::Closure* done);
+  void splitMultiGet(const gpb::MethodDescriptor* method, gpb::RpcController* controller,
+                     const MultiGetRequest* request, gpb::Message* response,
+                     gpb::Closure* done);
+  void broadcast(const gpb::MethodDescriptor* method, gpb::RpcController* controller,
+                 const gpb::Message* request, gpb::Message* response, gpb::Closure* done);
+  void issue(const gpb::MethodDescriptor* method, SplitCall* call);
+  void writeDone(SplitCall* call, Part* part);
+  void multiGetDone(SplitCall* call, Part* part);
+  void scanDone(SplitCall* call, Part* part);
+  void statsDone(SplitCall* call, Part* part);
+  void partDone(SplitCall* call, Part* part);
+  void finishScan(SplitCall* call);
+
+  evproto::EventLoop* loop_;
+  const int virtualNodes_;
+  std::map<std::string, Node*> nodes_;
+  std::map<uint64_t, Node*> ring_;
+
+  void operator=(const RouterChannel&);
+  RouterChannel(const RouterChannel&);
+};
+
+}
+
+#endif  // KVDB_ROUTERCHANNEL_H
@@ -0,0 +1,238 @@
+#include "ShardedDb.h"
+#include "GroupCommitter.h"
+#include "Hash.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+using namespace kvdb;
+
+namespace
+{
+
+// k-way merge of the shard iterators, keys never repeat across shards.
+class MergingIterator : public leveldb::Iterator
+{
+ public:
+  explicit MergingIterator(const std::vector<leveldb::Iterator*>& children)
+    : children_(children),
+      current_(NULL)
+  {
+  }
+
+  virtual ~MergingIterator()
+  {
+    for (size_t i = 0; i < children_.size(); ++i)
+    {
+      delete children_[i];
+    }
+  }
+
+  virtual bool Valid() const { return current_ != NULL; }
+
+  virtual void SeekToFirst()
+  {
+    for (size_t i = 0; i < children_.size(); ++i)
+    {
+      children_[i]->SeekToFirst();
+    }
+    findSmallest();
+  }
+
+  virtual void Seek(const leveldb::Slice& target)
+  {
+    for (size_t i = 0; i < children_.size(); ++i)
+    {
+      children_[i]->Seek(target);
+    }
+    findSmallest();
+  }
+
+  virtual void Next()
+  {
+    assert(Valid());
+    current_->Next();
+    findSmallest();
+  }
+
+  virtual void SeekToLast() { assert(0); }
+  virtual void Prev() { assert(0); }
+
+  virtual leveldb::Slice key() const { return current_->key(); }
+  virtual leveldb::Slice value() const { return current_->value(); }
+
+  virtual leveldb::Status status() const
+  {
+    for (size_t i = 0; i < children_.size(); ++i)
+    {
+      leveldb::Status s = children_[i]->status();
+      if (!s.ok())
+      {
+        return s;
+      }
+    }
+    return leveldb::Status();
+  }
+
+ private:
+  void findSmallest()
+  {
+    current_ = NULL;
+    for (size_t i = 0; i < children_.size(); ++i)
+    {
+      leveldb::Iterator* child = children_[i];
+      if (child->Valid() && (current_ == NULL || child->key().compare(current_->key()) < 0))
+      {
+        current_ = child;
+      }
+    }
+  }
+
+  std::vector<leveldb::Iterator*> children_;
+  leveldb::Iterator* current_;
+};
+
+}
+
+ShardedDb::Batch::Batch(int numShards)
+  : parts_(numShards),
+    counts_(numShards),
+    statuses_(numShards),
+    done_(NULL)
+{
+}
+
+leveldb::Status ShardedDb::Batch::status() const
+{
+  for (size_t i = 0; i < statuses_.size(); ++i)
+  {
+    if (!statuses_[i].ok())
+    {
+      return statuses_[i];
+    }
+  }
+  return leveldb::Status();
+}
+
+void ShardedDb::Batch::Iterate(leveldb::WriteBatch::Handler* handler) const
+{
+  for (size_t i = 0; i < parts_.size(); ++i)
+  {
+    if (counts_[i] > 0)
+    {
+      parts_[i].Iterate(handler);
+    }
+  }
+}
+
+ShardedDb::ShardedDb(const leveldb::Options& options, const std::string& name, int numShards)
+{
+  assert(numShards > 0);
+  for (int i = 0; i < numShards; ++i)
+  {
+    std::string path = name;
+    if (numShards > 1)
+    {
+      char buf[32];
+      snprintf(buf, sizeof buf, ".%d", i);
+      path += buf;
+    }
+    Shard shard = { NULL, NULL };
+    leveldb::Status status = leveldb::DB::Open(options, path, &shard.db);
+    assert(status.ok());
+    shard.committer = new GroupCommitter(shard.db, true);
+    shards_.push_back(shard);
+  }
+}
+
+ShardedDb::~ShardedDb()
+{
+  for (size_t i = 0; i < shards_.size(); ++i)
+  {
+    delete shards_[i].committer;
+    delete shards_[i].db;
+  }
+}
+
+void ShardedDb::start()
+{
+  for (size_t i = 0; i < shards_.size(); ++i)
+  {
+    shards_[i].committer->start();
+  }
+}
+
+int ShardedDb::shardOf(const leveldb::Slice& key) const
+{
+  if (shards_.size() == 1)
+  {
+    return 0;
+  }
+  return static_cast<int>(hash64(key.data(), key.size()) % shards_.size());
+}
+
+void ShardedDb::put(Batch* batch, const leveldb::Slice& key, const leveldb::Slice& value)
+{
+  int shard = shardOf(key);
+  batch->parts_[shard].Put(key, value);
+  ++batch->counts_[shard];
+}
+
+void ShardedDb::del(Batch* batch, const leveldb::Slice& key)
+{
+  int shard = shardOf(key);
+  batch->parts_[shard].Delete(key);
+  ++batch->counts_[shard];
+}
+
+void ShardedDb::commit(Batch* batch, ::google::protobuf::Closure* done)
+{
+  int parts = 0;
+  for (size_t i = 0; i < shards_.size(); ++i)
+  {
+    if (batch->counts_[i] > 0)
+    {
+      ++parts;
+    }
+  }
+
+  if (parts == 0)
+  {
+    done->Run();
+    return;
+  }
+
+  batch->done_ = done;
+  batch->remaining_.getAndSet(parts);
+  for (size_t i = 0; i < shards_.size(); ++i)
+  {
+    if (batch->counts_[i] > 0)
+    {
+      shards_[i].committer->commit(&batch->parts_[i], &batch->statuses_[i],
+          ::google::protobuf::NewCallback(this, &ShardedDb::partCommitted, batch));
+    }
+  }
+}
+
+void ShardedDb::partCommitted(Batch* batch)
+{
+  if (batch->remaining_.addAndGet(-1) == 0)
+  {
+    batch->done_->Run();
+  }
+}
+
+leveldb::Iterator* ShardedDb::newIterator(const leveldb::ReadOptions& options) const
+{
+  if (shards_.size() == 1)
+  {
+    return shards_[0].db->NewIterator(options);
+  }
+
+  std::vector<leveldb::Iterator*> children;
+  for (size_t i = 0; i < shards_.size(); ++i)
+  {
+    children.push_back(shards_[i].db->NewIterator(options));
+  }
+  return new MergingIterator(children);
+}
@@ -0,0 +1,86 @@
+#ifndef KVDB_SHARDEDDB_H
+#define KVDB_SHARDEDDB_H
+
+#include "../muduo/Atomic.h"
+
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+
+#include <google/protobuf/service.h>
+
+#include <string>
+#include <vector>
+
+namespace kvdb
+{
+
+class GroupCommitter;
+
+// The keyspace hash-partitioned over N leveldb instances, each with its
+// own directory, options and group commit thread.
+// With one shard, it is a plain leveldb at name.
+class ShardedDb // : boost::noncopyable
+{
+ public:
+  // The writes of one request, split by shard.
+  // Atomic within a shard, not across shards.
+  class Batch // : boost::noncopyable
+  {
+   public:
+    explicit Batch(int numShards);
+
+    leveldb::Status status() const;
+    void Iterate(leveldb::WriteBatch::Handler* handler) const;
+
+   private:
+    friend class ShardedDb;
+
+    std::vector<leveldb::WriteBatch> parts_;
+    std::vector<int> counts_;
+    std::vector<leveldb::Status> statuses_;
+    muduo::AtomicInt32 remaining_;
+    ::google::protobuf::Closure* done_;
+
+    void operator=(const Batch&);
+    Batch(const Batch&);
+  };
+
+  // shard i lives in name.i, options are copied for every shard
+  ShardedDb(const leveldb::Options& options, const std::string& name, int numShards);
+  ~ShardedDb();
+
+  void start();
+
+  int numShards() const { return static_cast<int>(shards_.size()); }
+  int shardOf(const leveldb::Slice& key) const;
+  leveldb::DB* db(int shard) const { return shards_[shard].db; }
+  leveldb::DB* dbOf(const leveldb::Slice& key) const { return db(shardOf(key)); }
+  const GroupCommitter* committer(int shard) const { return shards_[shard].committer; }
+
+  void put(Batch* batch, const leveldb::Slice& key, const leveldb::Slice& value);
+  void del(Batch* batch, const leveldb::Slice& key);
+  // Group commits each part in its shard, done runs after the last part
+  // is written, in the commit thread of that shard.
+  void commit(Batch* batch, ::google::protobuf::Closure* done);
+
+  // Iterates all shards in key order, forward only.
+  leveldb::Iterator* newIterator(const leveldb::ReadOptions& options) const;
+
+ private:
+  struct Shard
+  {
+    leveldb::DB* db;
+    GroupCommitter* committer;
+  };
+
+  void partCommitted(Batch* batch);
+
+  std::vector<Shard> shards_;
+
+  void operator=(const ShardedDb&);
+  ShardedDb(const ShardedDb&);
+};
+
+}
+
+#endif  // KVDB_SHARDEDDB_H
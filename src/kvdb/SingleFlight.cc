@@ -0,0 +1,90 @@
+#include "SingleFlight.h"
+#include "Hash.h"
+#include "kvdb.pb.h"
+
+#include <assert.h>
+
+using namespace kvdb;
+
+struct SingleFlight::Flight
+{
+  std::string key;
+  std::vector<Waiter> waiters;  // guarded by the mutex of the shard
+};
+
+SingleFlight::SingleFlight(int numShards)
+{
+  assert(numShards > 0);
+  for (int i = 0; i < numShards; ++i)
+  {
+    shards_.push_back(new Shard);
+  }
+}
+
+SingleFlight::~SingleFlight()
+{
+  for (size_t i = 0; i < shards_.size(); ++i)
+  {
+    assert(shards_[i]->flights.empty());
+    delete shards_[i];
+  }
+}
+
+SingleFlight::Shard& SingleFlight::shardOf(const std::string& key)
+{
+  return *shards_[hash64(key) % shards_.size()];
+}
+
+SingleFlight::Flight* SingleFlight::join(const std::string& key,
+                                         GetResponse* response,
+                                         ::google::protobuf::Closure* done)
+{
+  Shard& shard = shardOf(key);
+  muduo::MutexLockGuard lock(shard.mutex);
+  std::map<std::string, Flight*>::iterator it = shard.flights.find(key);
+  if (it != shard.flights.end())
+  {
+    Waiter w = { response, done };
+    it->second->waiters.push_back(w);
+    coalesced_.increment();
+    return NULL;
+  }
+  else
+  {
+    Flight* flight = new Flight;
+    flight->key = key;
+    shard.flights[key] = flight;
+    flights_.increment();
+    return flight;
+  }
+}
+
+void SingleFlight::finish(Flight* flight, const GetResponse& result)
+{
+  std::vector<Waiter> waiters;
+  {
+  Shard& shard = shardOf(flight->key);
+  muduo::MutexLockGuard lock(shard.mutex);
+  std::map<std::string, Flight*>::iterator it = shard.flights.find(flight->key);
+  if (it != shard.flights.end() && it->second == flight)
+  {
+    shard.flights.erase(it);
+  }
+  waiters.swap(flight->waiters);
+  }
+  delete flight;
+
+  for (size_t i = 0; i < waiters.size(); ++i)
+  {
+    waiters[i].response->CopyFrom(result);
+    waiters[i].done->Run();
+  }
+}
+
+void SingleFlight::forget(const std::string& key)
+{
+  Shard& shard = shardOf(key);
+  muduo::MutexLockGuard lock(shard.mutex);
+  // the leader still finishes it, no one else can join
+  shard.flights.erase(key);
+}
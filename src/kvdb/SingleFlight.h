@@ -0,0 +1,78 @@
+#ifndef KVDB_SINGLEFLIGHT_H
+#define KVDB_SINGLEFLIGHT_H
+
+#include "../muduo/Atomic.h"
+#include "../muduo/Mutex.h"
+
+#include <google/protobuf/service.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace kvdb
+{
+
+class GetResponse;
+
+// Coalesces concurrent Gets of the same key into one lookup.
+//
+// The first Get of a key leads the flight and does the lookup, later Gets
+// attach to it and are answered from the leader's result.
+// A write of the key detaches the flight, so Gets arriving after the write
+// start a new one instead of waiting for a possibly stale result.
+//
+// The leader looks up in its own thread, blocking it, so only Gets from
+// other threads can attach: with one loop thread (server without -t) no
+// two Gets are ever in flight together, and nothing is coalesced.
+class SingleFlight // : boost::noncopyable
+{
+ public:
+  struct Flight;
+
+  explicit SingleFlight(int numShards);
+  ~SingleFlight();
+
+  // Returns the flight to finish() if the caller leads, or NULL if the
+  // response and done were attached to a flight in progress.
+  Flight* join(const std::string& key,
+               GetResponse* response,
+               ::google::protobuf::Closure* done);
+
+  // Answers every attached Get with a copy of result, deletes flight.
+  void finish(Flight* flight, const GetResponse& result);
+
+  // Call after the write of key is visible in the db.
+  void forget(const std::string& key);
+
+  int64_t flights() const { return flights_.get(); }
+  int64_t coalesced() const { return coalesced_.get(); }
+
+ private:
+  struct Waiter
+  {
+    GetResponse* response;
+    ::google::protobuf::Closure* done;
+  };
+
+  struct Shard
+  {
+    Shard() : mutex("SingleFlight::Shard::mutex") {}
+
+    muduo::MutexLock mutex;
+    std::map<std::string, Flight*> flights;
+  };
+
+  Shard& shardOf(const std::string& key);
+
+  std::vector<Shard*> shards_;
+  muduo::AtomicInt64 flights_;
+  muduo::AtomicInt64 coalesced_;
+
+  void operator=(const SingleFlight&);
+  SingleFlight(const SingleFlight&);
+};
+
+}
+
+#endif  // KVDB_SINGLEFLIGHT_H
@@ -0,0 +1,111 @@
+#include "ValueCache.h"
+#include "Hash.h"
+
+#include <assert.h>
+
+using namespace kvdb;
+
+ValueCache::ValueCache(size_t capacity, int numShards)
+  : capacity_(capacity),
+    shardCapacity_(capacity / numShards)
+{
+  assert(numShards > 0);
+  for (int i = 0; i < numShards; ++i)
+  {
+    Shard* shard = new Shard;
+    shard->usage = 0;
+    shard->version = 0;
+    shards_.push_back(shard);
+  }
+}
+
+ValueCache::~ValueCache()
+{
+  for (size_t i = 0; i < shards_.size(); ++i)
+  {
+    delete shards_[i];
+  }
+}
+
+ValueCache::Shard& ValueCache::shardOf(const std::string& key)
+{
+  return *shards_[hash64(key) % shards_.size()];
+}
+
+bool ValueCache::lookup(const std::string& key, std::string* value, int64_t* version)
+{
+  Shard& shard = shardOf(key);
+  muduo::MutexLockGuard lock(shard.mutex);
+  std::map<std::string, EntryList::iterator>::iterator it = shard.index.find(key);
+  if (it != shard.index.end())
+  {
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    *value = it->second->value;
+    hits_.increment();
+    return true;
+  }
+  else
+  {
+    *version = shard.version;
+    misses_.increment();
+    return false;
+  }
+}
+
+void ValueCache::insert(const std::string& key, const std::string& value, int64_t version)
+{
+  const size_t size = charge(key, value);
+  if (size > shardCapacity_)
+  {
+    return;
+  }
+
+  Shard& shard = shardOf(key);
+  muduo::MutexLockGuard lock(shard.mutex);
+  if (shard.version != version)
+  {
+    return;
+  }
+
+  std::map<std::string, EntryList::iterator>::iterator it = shard.index.find(key);
+  if (it != shard.index.end())
+  {
+    remove(shard, it->second);
+  }
+
+  while (shard.usage + size > shardCapacity_)
+  {
+    assert(!shard.lru.empty());
+    remove(shard, --shard.lru.end());
+    evictions_.increment();
+  }
+
+  Entry e = { key, value };
+  shard.lru.push_front(e);
+  shard.index[key] = shard.lru.begin();
+  shard.usage += size;
+  bytes_.add(size);
+  entries_.increment();
+}
+
+void ValueCache::erase(const std::string& key)
+{
+  Shard& shard = shardOf(key);
+  muduo::MutexLockGuard lock(shard.mutex);
+  ++shard.version;
+  std::map<std::string, EntryList::iterator>::iterator it = shard.index.find(key);
+  if (it != shard.index.end())
+  {
+    remove(shard, it->second);
+  }
+}
+
+void ValueCache::remove(Shard& shard, EntryList::iterator it)
+{
+  const size_t size = charge(it->key, it->value);
+  shard.index.erase(it->key);
+  shard.lru.erase(it);
+  shard.usage -= size;
+  bytes_.add(-static_cast<int64_t>(size));
+  entries_.decrement();
+}
@@ -0,0 +1,84 @@
+#ifndef KVDB_VALUECACHE_H
+#define KVDB_VALUECACHE_H
+
+#include "../muduo/Atomic.h"
+#include "../muduo/Mutex.h"
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace kvdb
+{
+
+// Values of recently read keys, sharded by key hash, each shard is an LRU
+// list bounded by capacity/numShards bytes.
+//
+// A miss returns the version of the shard; insert() is dropped if any key
+// of the shard was erased since, so that a lookup racing with a write
+// never caches the old value.
+class ValueCache // : boost::noncopyable
+{
+ public:
+  ValueCache(size_t capacity, int numShards);
+  ~ValueCache();
+
+  // On a miss, returns false and the version to pass to insert().
+  bool lookup(const std::string& key, std::string* value, int64_t* version);
+  void insert(const std::string& key, const std::string& value, int64_t version);
+  // Call after the write of key is visible in the db.
+  void erase(const std::string& key);
+
+  size_t capacity() const { return capacity_; }
+  int64_t hits() const { return hits_.get(); }
+  int64_t misses() const { return misses_.get(); }
+  int64_t evictions() const { return evictions_.get(); }
+  int64_t bytes() const { return bytes_.get(); }
+  int64_t entries() const { return entries_.get(); }
+
+ private:
+  struct Entry
+  {
+    std::string key;
+    std::string value;
+  };
+  typedef std::list<Entry> EntryList;
+
+  struct Shard
+  {
+    Shard() : mutex("ValueCache::Shard::mutex") {}
+
+    muduo::MutexLock mutex;
+    EntryList lru;  // most recently used at front
+    std::map<std::string, EntryList::iterator> index;
+    size_t usage;
+    int64_t version;
+  };
+
+  Shard& shardOf(const std::string& key);
+  void remove(Shard& shard, EntryList::iterator it);
+
+  static size_t charge(const std::string& key, const std::string& value)
+  {
+    // node, map entry and string headers, roughly
+    return key.size() * 2 + value.size() + 128;
+  }
+
+  const size_t capacity_;
+  const size_t shardCapacity_;
+  std::vector<Shard*> shards_;
+
+  muduo::AtomicInt64 hits_;
+  muduo::AtomicInt64 misses_;
+  muduo::AtomicInt64 evictions_;
+  muduo::AtomicInt64 bytes_;
+  muduo::AtomicInt64 entries_;
+
+  void operator=(const ValueCache&);
+  ValueCache(const ValueCache&);
+};
+
+}
+
+#endif  // KVDB_VALUECACHE_H
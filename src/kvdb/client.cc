@@ -1,6 +1,10 @@
 #include "../RpcChannel.h"
 #include "../EventLoop.h"
 #include "kvdb.pb.h"
+#include "RouterChannel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
 
 void donePut(kvdb::PutResponse* response)
 {
@@ -12,16 +16,42 @@ void doneGet(kvdb::GetResponse* response)
   printf("get response: %s\n", response->DebugString().c_str());
 }
 
+void doneWrite(kvdb::WriteResponse* response)
+{
+  printf("write response: %s\n", response->DebugString().c_str());
+}
+
+void doneStats(kvdb::StatsResponse* response)
+{
+  for (int i = 0; i < response->counters_size(); ++i)
+  {
+    const kvdb::Counter& counter = response->counters(i);
+    printf("%s %lld\n", counter.name().c_str(), static_cast<long long>(counter.value()));
+  }
+}
+
 int main(int argc, char* argv[])
 {
   if (argc < 2)
   {
-    printf("Usage: client server_addr\n");
+    printf("Usage: client server_addr[:port]|shm_path ...\n");
     return 0;
   }
 
   evproto::EventLoop loop;
-  evproto::RpcChannel channel(&loop, argv[1], 12345);
+  kvdb::RouterChannel channel(&loop);
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string host = argv[i];
+    int port = 12345;
+    size_t colon = host.find(':');
+    if (colon != std::string::npos)
+    {
+      port = atoi(host.c_str() + colon + 1);
+      host.erase(colon);
+    }
+    channel.addNode(host, port);
+  }
   kvdb::LeveldbService::Stub remoteService(&channel);
 
   {
@@ -39,5 +69,26 @@ int main(int argc, char* argv[])
     remoteService.Get(NULL, &request, response, NewCallback(&doneGet, response));
   }
 
+  {
+    kvdb::WriteRequest request;
+    for (int i = 0; i < 10; ++i)
+    {
+      char key[32];
+      snprintf(key, sizeof key, "key%d", i);
+      kvdb::WriteOperation* op = request.add_operations();
+      op->set_type(kvdb::WriteOperation::PUT);
+      op->set_key(key);
+      op->set_value(channel.nodeOf(key));
+    }
+    kvdb::WriteResponse* response = new kvdb::WriteResponse;
+    remoteService.Write(NULL, &request, response, NewCallback(&doneWrite, response));
+  }
+
+  {
+    kvdb::StatsRequest request;
+    kvdb::StatsResponse* response = new kvdb::StatsResponse;
+    remoteService.Stats(NULL, &request, response, NewCallback(&doneStats, response));
+  }
+
   loop.loop();
 }
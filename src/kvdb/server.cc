@@ -1,25 +1,113 @@
 #include "../RpcChannel.h"
 #include "../RpcServer.h"
 #include "../EventLoop.h"
+#include "../RpcController.h"
 #include "kvdb.pb.h"
+#include "GroupCommitter.h"
+#include "ShardedDb.h"
+#include "SingleFlight.h"
+#include "ValueCache.h"
 
 #include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+
+#include <algorithm>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 namespace kvdb
 {
 
+// Drops the keys of a committed batch from the cache and the Gets in flight.
+class Invalidator : public leveldb::WriteBatch::Handler
+{
+ public:
+  Invalidator(ValueCache* cache, SingleFlight* flights)
+    : cache_(cache),
+      flights_(flights)
+  {
+  }
+
+  virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value)
+  {
+    invalidate(key.ToString());
+  }
+
+  virtual void Delete(const leveldb::Slice& key)
+  {
+    invalidate(key.ToString());
+  }
+
+ private:
+  void invalidate(const std::string& key)
+  {
+    if (cache_)
+    {
+      cache_->erase(key);
+    }
+    flights_->forget(key);
+  }
+
+  ValueCache* cache_;
+  SingleFlight* flights_;
+};
+
 class LeveldbServiceImpl : public LeveldbService
 {
  public:
-  LeveldbServiceImpl(const leveldb::Options& options, const std::string& name)
+  // cacheBytes == 0 disables the value cache. The db is opened by open(),
+  // before any request.
+  LeveldbServiceImpl(const leveldb::Options& options, const std::string& name,
+                     int numShards, size_t cacheBytes)
+    : options_(options),
+      name_(name),
+      numShards_(numShards),
+      db_(NULL),
+      cache_(cacheBytes > 0 ? new ValueCache(cacheBytes, kCacheShards) : NULL),
+      flights_(kCacheShards),
+      server_(NULL)
+  {
+  }
+
+  void open()
+  {
+    assert(db_ == NULL);
+    db_ = new ShardedDb(options_, name_, numShards_);
+    db_->start();
+  }
+
+  // after the last request, the writes queued are committed first
+  void close()
+  {
+    delete db_;
+    db_ = NULL;
+  }
+
+  // RpcServer::setHandOffCallbacks(), a hot restart opens the db once the
+  // predecessor has closed it
+  static void openCallback(void* arg)
   {
-    leveldb::Status status = leveldb::DB::Open(options, name, &db);
-    assert(status.ok());
+    static_cast<LeveldbServiceImpl*>(arg)->open();
+  }
+
+  static void closeCallback(void* arg)
+  {
+    static_cast<LeveldbServiceImpl*>(arg)->close();
+  }
+
+  // for connection and loop counters in Stats
+  void setRpcServer(evproto::RpcServer* server)
+  {
+    server_ = server;
   }
 
   ~LeveldbServiceImpl()
   {
-    delete db;
+    delete db_;
+    delete cache_;
   }
 
   virtual void Get(::google::protobuf::RpcController* controller,
@@ -27,10 +115,34 @@ class LeveldbServiceImpl : public LeveldbService
                        ::kvdb::GetResponse* response,
                        ::google::protobuf::Closure* done)
   {
-    leveldb::Status s = db->Get(leveldb::ReadOptions(),
-                                request->key(),
-                                response->mutable_value());
-    allDone(s, response, done);
+    int64_t version = 0;
+    if (cache_ && cache_->lookup(request->key(), response->mutable_value(), &version))
+    {
+      response->set_status(OK);
+      attachValue(controller, response);
+      done->Run();
+      return;
+    }
+
+    // coalesces only with Gets of other loop threads, -t N
+    SingleFlight::Flight* flight = flights_.join(request->key(), response, done);
+    if (flight == NULL)
+    {
+      // answered by the Get already looking up this key
+      return;
+    }
+
+    leveldb::Status s = db_->dbOf(request->key())->Get(leveldb::ReadOptions(),
+                                                      request->key(),
+                                                      response->mutable_value());
+    if (cache_ && s.ok())
+    {
+      cache_->insert(request->key(), response->value(), version);
+    }
+    response->set_status(s.ok() ? OK : NOTFOUND);
+    flights_.finish(flight, *response);
+    attachValue(controller, response);
+    done->Run();
   }
 
   virtual void Put(::google::protobuf::RpcController* controller,
@@ -38,10 +150,9 @@ class LeveldbServiceImpl : public LeveldbService
                        ::kvdb::PutResponse* response,
                        ::google::protobuf::Closure* done)
   {
-    leveldb::Status s = db->Put(leveldb::WriteOptions(),
-                                request->key(),
-                                request->value());
-    allDone(s, response, done);
+    PendingWrite<PutResponse>* pending = newWrite(response, done);
+    db_->put(&pending->batch, request->key(), request->value());
+    commit(pending);
   }
 
   virtual void Delete(::google::protobuf::RpcController* controller,
@@ -49,9 +160,9 @@ class LeveldbServiceImpl : public LeveldbService
                        ::kvdb::DeleteResponse* response,
                        ::google::protobuf::Closure* done)
   {
-    leveldb::Status s = db->Delete(leveldb::WriteOptions(),
-                                   request->key());
-    allDone(s, response, done);
+    PendingWrite<DeleteResponse>* pending = newWrite(response, done);
+    db_->del(&pending->batch, request->key());
+    commit(pending);
   }
 
   virtual void Write(::google::protobuf::RpcController* controller,
@@ -59,11 +170,221 @@ class LeveldbServiceImpl : public LeveldbService
                        ::kvdb::WriteResponse* response,
                        ::google::protobuf::Closure* done)
   {
-    assert(0);
+    PendingWrite<WriteResponse>* pending = newWrite(response, done);
+    for (int i = 0; i < request->operations_size(); ++i)
+    {
+      const WriteOperation& op = request->operations(i);
+      if (op.type() == WriteOperation::PUT)
+      {
+        db_->put(&pending->batch, op.key(), op.value());
+      }
+      else
+      {
+        db_->del(&pending->batch, op.key());
+      }
+    }
+    commit(pending);
+  }
+
+  virtual void MultiGet(::google::protobuf::RpcController* controller,
+                       const ::kvdb::MultiGetRequest* request,
+                       ::kvdb::MultiGetResponse* response,
+                       ::google::protobuf::Closure* done)
+  {
+    // one snapshot per shard
+    std::vector<leveldb::ReadOptions> options(db_->numShards());
+    for (int i = 0; i < db_->numShards(); ++i)
+    {
+      options[i].snapshot = db_->db(i)->GetSnapshot();
+    }
+    for (int i = 0; i < request->keys_size(); ++i)
+    {
+      GetResponse* value = response->add_values();
+      int shard = db_->shardOf(request->keys(i));
+      leveldb::Status s = db_->db(shard)->Get(options[shard],
+                                              request->keys(i),
+                                              value->mutable_value());
+      value->set_status(s.ok() ? OK : NOTFOUND);
+    }
+    for (int i = 0; i < db_->numShards(); ++i)
+    {
+      db_->db(i)->ReleaseSnapshot(options[i].snapshot);
+    }
+    done->Run();
+  }
+
+  virtual void Scan(::google::protobuf::RpcController* controller,
+                       const ::kvdb::ScanRequest* request,
+                       ::kvdb::ScanResponse* response,
+                       ::google::protobuf::Closure* done)
+  {
+    const int limit = std::min(std::max(request->limit(), 1), kMaxScanLimit);
+    const bool bounded = !request->end_key().empty();
+    const leveldb::Slice end(request->end_key());
+    size_t bytes = 0;
+
+    leveldb::ReadOptions options;
+    options.fill_cache = false;
+    leveldb::Iterator* it = db_->newIterator(options);
+    for (it->Seek(request->start_key());
+         it->Valid() && !(bounded && it->key().compare(end) >= 0);
+         it->Next())
+    {
+      if (response->kvs_size() >= limit || bytes >= kMaxScanBytes)
+      {
+        response->set_next_key(it->key().data(), it->key().size());
+        break;
+      }
+      KeyValue* kv = response->add_kvs();
+      kv->set_key(it->key().data(), it->key().size());
+      kv->set_value(it->value().data(), it->value().size());
+      bytes += it->key().size() + it->value().size();
+    }
+    leveldb::Status s = it->status();
+    delete it;
+    allDone(s, response, done);
+  }
+
+  virtual void Stats(::google::protobuf::RpcController* controller,
+                       const ::kvdb::StatsRequest* request,
+                       ::kvdb::StatsResponse* response,
+                       ::google::protobuf::Closure* done)
+  {
+    int64_t groups = 0;
+    int64_t batches = 0;
+    for (int i = 0; i < db_->numShards(); ++i)
+    {
+      groups += db_->committer(i)->numGroups();
+      batches += db_->committer(i)->numBatches();
+    }
+    addCounter(response, "shards", db_->numShards());
+    addCounter(response, "commit.groups", groups);
+    addCounter(response, "commit.batches", batches);
+    addCounter(response, "get.lookups", flights_.flights());
+    addCounter(response, "get.coalesced", flights_.coalesced());
+    if (cache_)
+    {
+      int64_t hits = cache_->hits();
+      int64_t lookups = hits + cache_->misses();
+      addCounter(response, "cache.capacity", cache_->capacity());
+      addCounter(response, "cache.bytes", cache_->bytes());
+      addCounter(response, "cache.entries", cache_->entries());
+      addCounter(response, "cache.hits", hits);
+      addCounter(response, "cache.misses", cache_->misses());
+      addCounter(response, "cache.evictions", cache_->evictions());
+      addCounter(response, "cache.hit_permille", lookups > 0 ? hits * 1000 / lookups : 0);
+    }
+    if (server_)
+    {
+      addCounter(response, "rpc.connections", server_->numConnections());
+      addCounter(response, "rpc.memory", server_->memoryUsage());
+      addCounter(response, "rpc.idle_closed", server_->idleClosed());
+      addCounter(response, "rpc.budget_closed", server_->budgetClosed());
+      addCounter(response, "rpc.handed_off", server_->handedOff());
+      for (size_t i = 0; i < server_->numLoops(); ++i)
+      {
+        const evproto::ReadStats& stats = server_->readStats(i);
+        char prefix[32];
+        snprintf(prefix, sizeof prefix, "loop.%zu.", i);
+        addCounter(response, std::string(prefix) + "callbacks", stats.callbacks.get());
+        addCounter(response, std::string(prefix) + "frames", stats.frames.get());
+        addCounter(response, std::string(prefix) + "yields", stats.yields.get());
+        addCounter(response, std::string(prefix) + "busy_us", stats.busyNanos.get() / 1000);
+        addCounter(response, std::string(prefix) + "max_callback_us",
+                   stats.maxCallbackNanos.get() / 1000);
+        addCounter(response, std::string(prefix) + "resume_us", stats.resumeNanos.get() / 1000);
+        addCounter(response, std::string(prefix) + "max_resume_us",
+                   stats.maxResumeNanos.get() / 1000);
+      }
+    }
+#ifdef MUDUO_MUTEX_PROFILING
+    std::vector<muduo::MutexStats> locks = muduo::mutexStats();
+    for (size_t i = 0; i < locks.size(); ++i)
+    {
+      const std::string prefix = std::string("lock.") + locks[i].name;
+      addCounter(response, prefix + ".acquisitions", locks[i].acquisitions);
+      addCounter(response, prefix + ".contended", locks[i].contended);
+      addCounter(response, prefix + ".wait_us", locks[i].waitNanos / 1000);
+      addCounter(response, prefix + ".hold_us", locks[i].holdNanos / 1000);
+    }
+#endif
+    done->Run();
   }
 
  private:
 
+  static const int kCacheShards = 16;
+  static const int kMaxScanLimit = 10000;
+  static const size_t kMaxScanBytes = 4 * 1024 * 1024;
+  static const size_t kAttachValueBytes = 64 * 1024;
+
+  static void deleteValue(const void* data, size_t len, void* arg)
+  {
+    delete static_cast<std::string*>(arg);
+  }
+
+  // Sends a large value to the socket by reference, instead of copying it
+  // into the response, then the RpcMessage, then the output buffer.
+  static void attachValue(::google::protobuf::RpcController* controller,
+                          GetResponse* response)
+  {
+    evproto::RpcController* rpcController = dynamic_cast<evproto::RpcController*>(controller);
+    if (rpcController && response->value().size() >= kAttachValueBytes)
+    {
+      std::string* value = new std::string;
+      value->swap(*response->mutable_value());
+      response->clear_value();
+      rpcController->setResponseAttachment(GetResponse::kValueFieldNumber,
+                                           value->data(), value->size(),
+                                           &deleteValue, value);
+    }
+  }
+
+  static void addCounter(StatsResponse* response, const std::string& name, int64_t value)
+  {
+    Counter* counter = response->add_counters();
+    counter->set_name(name);
+    counter->set_value(value);
+  }
+
+  template<typename RESPONSE>
+  struct PendingWrite
+  {
+    PendingWrite(int numShards, RESPONSE* r, ::google::protobuf::Closure* d)
+      : batch(numShards),
+        response(r),
+        done(d)
+    {
+    }
+
+    ShardedDb::Batch batch;
+    RESPONSE* response;
+    ::google::protobuf::Closure* done;
+  };
+
+  template<typename RESPONSE>
+  PendingWrite<RESPONSE>* newWrite(RESPONSE* response, ::google::protobuf::Closure* done)
+  {
+    return new PendingWrite<RESPONSE>(db_->numShards(), response, done);
+  }
+
+  // done runs in a commit thread, after every shard of batch is written.
+  template<typename RESPONSE>
+  void commit(PendingWrite<RESPONSE>* pending)
+  {
+    db_->commit(&pending->batch,
+        ::google::protobuf::NewCallback(this, &LeveldbServiceImpl::committed<RESPONSE>, pending));
+  }
+
+  template<typename RESPONSE>
+  void committed(PendingWrite<RESPONSE>* pending)
+  {
+    Invalidator invalidator(cache_, &flights_);
+    pending->batch.Iterate(&invalidator);
+    allDone(pending->batch.status(), pending->response, pending->done);
+    delete pending;
+  }
+
   template<typename RESPONSE>
   void allDone(const leveldb::Status& status,
                RESPONSE* response,
@@ -80,25 +401,109 @@ class LeveldbServiceImpl : public LeveldbService
     done->Run();
   }
 
-  leveldb::DB* db;
+  const leveldb::Options options_;
+  const std::string name_;
+  const int numShards_;
+  ShardedDb* db_;
+  ValueCache* cache_;
+  SingleFlight flights_;
+  evproto::RpcServer* server_;
 };
 
+// std::min() takes it by reference
+const int LeveldbServiceImpl::kMaxScanLimit;
+
 }
 
 int main(int argc, char* argv[])
 {
+  int numThreads = 0;
+  int numShards = 1;
+  size_t cacheBytes = 64 * 1024 * 1024;
+  int port = 12345;
+  const char* path = "/tmp/testdb";
+  int idleSeconds = 0;
+  int64_t memoryBytes = 0;
+  size_t sliceBytes = 0;
+  int budgetFrames = 0;
+  int budgetMicros = 0;
+  const char* shmPath = NULL;
+  std::string restartPath;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:t:s:c:d:i:m:l:f:u:x:r:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 't':
+        numThreads = atoi(optarg);
+        break;
+      case 's':
+        numShards = atoi(optarg);
+        break;
+      case 'd':
+        path = optarg;
+        break;
+      case 'c':
+        cacheBytes = static_cast<size_t>(atoi(optarg)) * 1024 * 1024;
+        break;
+      case 'i':
+        idleSeconds = atoi(optarg);
+        break;
+      case 'm':
+        memoryBytes = static_cast<int64_t>(atoi(optarg)) * 1024 * 1024;
+        break;
+      case 'l':
+        sliceBytes = static_cast<size_t>(atoi(optarg)) * 1024;
+        break;
+      case 'f':
+        budgetFrames = atoi(optarg);
+        break;
+      case 'u':
+        budgetMicros = atoi(optarg);
+        break;
+      case 'x':
+        shmPath = optarg;
+        break;
+      case 'r':
+        restartPath = optarg;
+        break;
+      default:
+        printf("Usage: server [-p port] [-t threads] [-s shards] [-c cache_mb] [-d db_path]\n"
+               "              [-i idle_seconds] [-m connection_memory_mb] [-l slice_kb]\n"
+               "              [-f read_budget_frames] [-u read_budget_us] [-x shm_path]\n"
+               "              [-r restart_path]\n"
+               "  -t  loop threads, concurrent Gets of a key are coalesced only across them\n"
+               "  -f, -u  read budget per connection, also counts the loop.N.* stats\n"
+               "  -r  hot restart: take over from the server at restart_path, if any;\n"
+               "      its connections are taken over at once, but their requests wait\n"
+               "      until it has served its last one and closed the db\n");
+        return 0;
+    }
+  }
+
   evproto::EventLoop loop;
-  evproto::RpcServer server(&loop, 12345);
-  if (argc > 1)
+  evproto::RpcServer server(&loop, port, restartPath);
+  server.setThreadNum(numThreads);
+  server.setIdleTimeout(idleSeconds);
+  server.setMemoryBudget(memoryBytes);
+  server.setSliceBytes(sliceBytes);
+  server.setReadBudget(budgetFrames, budgetMicros);
+  if (shmPath)
   {
-    int numThreads = atoi(argv[1]);
-    server.setThreadNum(numThreads);
+    server.listenShm(shmPath);
   }
 
   leveldb::Options options;
   options.create_if_missing = true;
-  kvdb::LeveldbServiceImpl impl(options, "/tmp/testdb");
+  kvdb::LeveldbServiceImpl impl(options, path, std::max(numShards, 1), cacheBytes);
+  impl.setRpcServer(&server);
   server.registerService(&impl);
+  // opens the db now, or once the predecessor has closed it
+  server.setHandOffCallbacks(&kvdb::LeveldbServiceImpl::openCallback,
+                             &kvdb::LeveldbServiceImpl::closeCallback, &impl);
 
   // server.start();
   loop.loop();
@@ -0,0 +1,744 @@
+#include "../EventLoop.h"
+#include "../RpcController.h"
+#include "../muduo/Atomic.h"
+#include "../muduo/Mutex.h"
+#include "../test/Histogram.h"
+#include "kvdb.pb.h"
+#include "Hash.h"
+#include "RouterChannel.h"
+
+#include <event2/event.h>
+
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+// YCSB core workloads against LeveldbService, closed loop, so latencies
+// are not corrected for coordinated omission, see test/bench.cc.
+//
+//   A  50% read, 50% update, zipfian
+//   B  95% read,  5% update, zipfian
+//   C 100% read, zipfian
+//   D  95% read,  5% insert, latest
+//   E  95% scan,  5% insert, zipfian start key, 1-100 records
+//   F  50% read, 50% read-modify-write, zipfian
+//
+// -u replaces zipfian by uniform. With -l, the records are loaded first
+// with Write batches. Every connection is a RouterChannel over all servers;
+// Scan is merged from all of them.
+
+using evproto::test::Histogram;
+using evproto::test::nowNanos;
+
+namespace
+{
+
+enum OpType
+{
+  kRead,
+  kUpdate,
+  kInsert,
+  kScan,
+  kReadModifyWrite,
+  kNumOpTypes,
+};
+
+const char* kOpNames[kNumOpTypes] = { "READ", "UPDATE", "INSERT", "SCAN", "RMW" };
+
+struct Workload
+{
+  double proportions[kNumOpTypes];
+  bool latest;
+};
+
+struct Options
+{
+  std::vector<std::string> servers;
+  char workload;
+  bool uniform;
+  int64_t records;
+  int valueSize;
+  int connections;
+  int threads;
+  int depth;
+  int duration;
+  bool load;
+  int batch;
+};
+
+// As YCSB's AcknowledgedCounterGenerator: inserts take record numbers in
+// order, but their Puts complete in any order, so reads pick from below
+// limit(), the first record whose insert is not acknowledged yet.
+class AcknowledgedCounter // : boost::noncopyable
+{
+ public:
+  AcknowledgedCounter()
+    : mutex_("AcknowledgedCounter::mutex_")
+  {
+  }
+
+  // records 0 .. records-1 exist
+  void reset(int64_t records)
+  {
+    next_.getAndSet(records);
+    limit_.getAndSet(records);
+  }
+
+  int64_t next() { return next_.getAndAdd(1); }
+
+  void acknowledge(int64_t record)
+  {
+    muduo::MutexLockGuard lock(mutex_);
+    acknowledged_.insert(record);
+    int64_t limit = limit_.get();
+    while (!acknowledged_.empty() && *acknowledged_.begin() == limit)
+    {
+      acknowledged_.erase(acknowledged_.begin());
+      ++limit;
+    }
+    limit_.getAndSet(limit);
+  }
+
+  int64_t limit() const { return limit_.get(); }
+
+ private:
+  muduo::AtomicInt64 next_;
+  muduo::AtomicInt64 limit_;
+  muduo::MutexLock mutex_;
+  std::set<int64_t> acknowledged_;   // at or above limit_
+
+  void operator=(const AcknowledgedCounter&);
+  AcknowledgedCounter(const AcknowledgedCounter&);
+};
+
+Options g_options;
+Workload g_workload;
+AcknowledgedCounter g_inserted;
+std::string g_value;
+
+// xorshift64*
+class Random
+{
+ public:
+  explicit Random(uint64_t seed) : state_(seed | 1) {}
+
+  uint64_t next()
+  {
+    state_ ^= state_ >> 12;
+    state_ ^= state_ << 25;
+    state_ ^= state_ >> 27;
+    return state_ * 2685821657736338717ULL;
+  }
+
+  // [0, 1)
+  double nextDouble()
+  {
+    return (next() >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  int64_t uniform(int64_t n)
+  {
+    return static_cast<int64_t>(next() % static_cast<uint64_t>(n));
+  }
+
+ private:
+  uint64_t state_;
+};
+
+// Gray et al., "Quickly generating billion-record synthetic databases",
+// as in YCSB's ZipfianGenerator, item 0 is the most popular.
+class Zipfian
+{
+ public:
+  explicit Zipfian(int64_t items, double theta = 0.99)
+    : items_(items),
+      theta_(theta),
+      zeta2_(zeta(2, theta)),
+      zetan_(zeta(items, theta)),
+      alpha_(1.0 / (1.0 - theta)),
+      eta_((1 - pow(2.0 / items, 1 - theta)) / (1 - zeta2_ / zetan_))
+  {
+  }
+
+  int64_t next(Random* random) const
+  {
+    double u = random->nextDouble();
+    double uz = u * zetan_;
+    if (uz < 1.0)
+    {
+      return 0;
+    }
+    if (uz < 1.0 + pow(0.5, theta_))
+    {
+      return 1;
+    }
+    int64_t item = static_cast<int64_t>(items_ * pow(eta_ * u - eta_ + 1, alpha_));
+    return item < items_ ? item : items_ - 1;
+  }
+
+ private:
+  static double zeta(int64_t n, double theta)
+  {
+    double sum = 0;
+    for (int64_t i = 0; i < n; ++i)
+    {
+      sum += 1 / pow(static_cast<double>(i + 1), theta);
+    }
+    return sum;
+  }
+
+  const int64_t items_;
+  const double theta_;
+  const double zeta2_;
+  const double zetan_;
+  const double alpha_;
+  const double eta_;
+};
+
+const Zipfian* g_zipfian = NULL;
+
+// spread popular record numbers over the key space
+std::string keyOf(int64_t record)
+{
+  char buf[32];
+  snprintf(buf, sizeof buf, "user%016llx",
+           static_cast<unsigned long long>(kvdb::hash64(reinterpret_cast<const char*>(&record),
+                                                        sizeof record)));
+  return buf;
+}
+
+struct ThreadData
+{
+  pthread_t thread;
+  int connections;
+  int64_t loadBegin;
+  int64_t loadEnd;
+  Histogram histograms[kNumOpTypes];
+  int64_t errors;
+  int64_t failed;    // calls that failed, not in the histograms
+};
+
+class Connection // : boost::noncopyable
+{
+ public:
+  Connection(evproto::EventLoop* loop, ThreadData* data, uint64_t seed)
+    : data_(data),
+      channel_(loop),
+      stub_(&channel_),
+      random_(seed),
+      inflight_(0),
+      loadNext_(0),
+      loadEnd_(0)
+  {
+    for (size_t i = 0; i < g_options.servers.size(); ++i)
+    {
+      std::string host = g_options.servers[i];
+      int port = 12345;
+      size_t colon = host.find(':');
+      if (colon != std::string::npos)
+      {
+        port = atoi(host.c_str() + colon + 1);
+        host.erase(colon);
+      }
+      channel_.addNode(host, port);
+    }
+  }
+
+  // records [begin, end) with Write batches, calls loaded when done
+  void load(int64_t begin, int64_t end, void (*loaded)(void*), void* arg)
+  {
+    loadNext_ = begin;
+    loadEnd_ = end;
+    loaded_ = loaded;
+    loadedArg_ = arg;
+    for (int i = 0; i < g_options.depth; ++i)
+    {
+      sendBatch();
+    }
+    if (inflight_ == 0)
+    {
+      loaded_(loadedArg_);
+    }
+  }
+
+  void run()
+  {
+    for (int i = 0; i < g_options.depth; ++i)
+    {
+      sendOp();
+    }
+  }
+
+ private:
+  struct Op
+  {
+    OpType type;
+    int64_t start;
+    int64_t record;
+    std::string key;
+    evproto::RpcController controller;
+  };
+
+  int64_t chooseRecord()
+  {
+    int64_t n = g_inserted.limit();
+    if (g_workload.latest)
+    {
+      int64_t r = g_options.uniform ? random_.uniform(n) : g_zipfian->next(&random_) % n;
+      return n - 1 - r;
+    }
+    if (g_options.uniform)
+    {
+      return random_.uniform(n);
+    }
+    // scrambled zipfian
+    int64_t r = g_zipfian->next(&random_);
+    return static_cast<int64_t>(kvdb::hash64(reinterpret_cast<const char*>(&r), sizeof r)
+                                % static_cast<uint64_t>(n));
+  }
+
+  OpType chooseOp()
+  {
+    double u = random_.nextDouble();
+    for (int i = 0; i < kNumOpTypes; ++i)
+    {
+      u -= g_workload.proportions[i];
+      if (u < 0)
+      {
+        return static_cast<OpType>(i);
+      }
+    }
+    return kRead;
+  }
+
+  void sendOp()
+  {
+    ++inflight_;
+    Op* op = new Op;
+    op->type = chooseOp();
+    op->start = nowNanos();
+    op->record = op->type == kInsert ? g_inserted.next() : chooseRecord();
+    op->key = keyOf(op->record);
+
+    switch (op->type)
+    {
+      case kRead:
+      case kReadModifyWrite:
+        get(op);
+        break;
+      case kUpdate:
+      case kInsert:
+        put(op);
+        break;
+      case kScan:
+        scan(op);
+        break;
+      default:
+        assert(0);
+    }
+  }
+
+  void get(Op* op)
+  {
+    kvdb::GetRequest request;
+    request.set_key(op->key);
+    kvdb::GetResponse* response = new kvdb::GetResponse;
+    op->controller.Reset();
+    stub_.Get(&op->controller, &request, response,
+              ::google::protobuf::NewCallback(this, &Connection::onGet, op, response));
+  }
+
+  void put(Op* op)
+  {
+    kvdb::PutRequest request;
+    request.set_key(op->key);
+    request.set_value(g_value);
+    kvdb::PutResponse* response = new kvdb::PutResponse;
+    op->controller.Reset();
+    stub_.Put(&op->controller, &request, response,
+              ::google::protobuf::NewCallback(this, &Connection::onPut, op, response));
+  }
+
+  void scan(Op* op)
+  {
+    kvdb::ScanRequest request;
+    request.set_start_key(op->key);
+    request.set_limit(static_cast<int>(random_.uniform(100)) + 1);
+    kvdb::ScanResponse* response = new kvdb::ScanResponse;
+    op->controller.Reset();
+    stub_.Scan(&op->controller, &request, response,
+               ::google::protobuf::NewCallback(this, &Connection::onScan, op, response));
+  }
+
+  void onGet(Op* op, kvdb::GetResponse* response)
+  {
+    if (op->controller.Failed())
+    {
+      finish(op);
+      return;
+    }
+    if (response->status() != kvdb::OK)
+    {
+      ++data_->errors;
+    }
+    if (op->type == kReadModifyWrite)
+    {
+      put(op);
+    }
+    else
+    {
+      finish(op);
+    }
+  }
+
+  void onPut(Op* op, kvdb::PutResponse* response)
+  {
+    if (!op->controller.Failed() && response->status() != kvdb::OK)
+    {
+      ++data_->errors;
+    }
+    if (op->type == kInsert)
+    {
+      // failed or not, as YCSB does, or the reads never get past it
+      g_inserted.acknowledge(op->record);
+    }
+    finish(op);
+  }
+
+  void onScan(Op* op, kvdb::ScanResponse* response)
+  {
+    if (!op->controller.Failed() && response->status() != kvdb::OK)
+    {
+      ++data_->errors;
+    }
+    finish(op);
+  }
+
+  // a failed call has a default response, status OK, and no latency
+  void finish(Op* op)
+  {
+    if (op->controller.Failed())
+    {
+      ++data_->failed;
+    }
+    else
+    {
+      data_->histograms[op->type].record(nowNanos() - op->start);
+    }
+    delete op;
+    --inflight_;
+    sendOp();
+  }
+
+  void sendBatch()
+  {
+    if (loadNext_ >= loadEnd_)
+    {
+      return;
+    }
+    kvdb::WriteRequest request;
+    for (int i = 0; i < g_options.batch && loadNext_ < loadEnd_; ++i)
+    {
+      kvdb::WriteOperation* op = request.add_operations();
+      op->set_type(kvdb::WriteOperation::PUT);
+      op->set_key(keyOf(loadNext_++));
+      op->set_value(g_value);
+    }
+    ++inflight_;
+    evproto::RpcController* controller = new evproto::RpcController;
+    kvdb::WriteResponse* response = new kvdb::WriteResponse;
+    stub_.Write(controller, &request, response,
+                ::google::protobuf::NewCallback(this, &Connection::onBatch, controller, response));
+  }
+
+  void onBatch(evproto::RpcController* controller, kvdb::WriteResponse* response)
+  {
+    if (controller->Failed())
+    {
+      ++data_->failed;
+    }
+    else if (response->status() != kvdb::OK)
+    {
+      ++data_->errors;
+    }
+    delete controller;
+    --inflight_;
+    sendBatch();
+    if (inflight_ == 0)
+    {
+      loaded_(loadedArg_);
+    }
+  }
+
+  ThreadData* data_;
+  kvdb::RouterChannel channel_;
+  kvdb::LeveldbService::Stub stub_;
+  Random random_;
+  int inflight_;
+  int64_t loadNext_;
+  int64_t loadEnd_;
+  void (*loaded_)(void*);
+  void* loadedArg_;
+};
+
+struct Runner
+{
+  evproto::EventLoop* loop;
+  std::vector<Connection*> connections;
+  int loading;
+};
+
+void connectionLoaded(void* arg)
+{
+  Runner* runner = static_cast<Runner*>(arg);
+  if (--runner->loading == 0)
+  {
+    event_base_loopbreak(runner->loop->eventBase());
+  }
+}
+
+pthread_barrier_t g_loaded;
+
+void* runThread(void* ptr)
+{
+  ThreadData* data = static_cast<ThreadData*>(ptr);
+  evproto::EventLoop loop;
+  Runner runner;
+  runner.loop = &loop;
+  for (int i = 0; i < data->connections; ++i)
+  {
+    uint64_t seed = reinterpret_cast<uintptr_t>(data) * 31 + i;
+    runner.connections.push_back(new Connection(&loop, data, seed));
+  }
+
+  const int n = static_cast<int>(runner.connections.size());
+  const int64_t records = data->loadEnd - data->loadBegin;
+  runner.loading = n;
+  if (records > 0)
+  {
+    for (int i = 0; i < n; ++i)
+    {
+      runner.connections[i]->load(data->loadBegin + records * i / n,
+                                  data->loadBegin + records * (i + 1) / n,
+                                  connectionLoaded, &runner);
+    }
+    if (runner.loading > 0)
+    {
+      loop.loop();
+    }
+  }
+  pthread_barrier_wait(&g_loaded);
+
+  for (int i = 0; i < n; ++i)
+  {
+    runner.connections[i]->run();
+  }
+  struct timeval tv = { g_options.duration, 0 };
+  event_base_loopexit(loop.eventBase(), &tv);
+  loop.loop();
+
+  for (int i = 0; i < n; ++i)
+  {
+    delete runner.connections[i];
+  }
+  return NULL;
+}
+
+bool setWorkload(char w)
+{
+  Workload workload;
+  memset(&workload, 0, sizeof workload);
+  switch (w)
+  {
+    case 'a':
+      workload.proportions[kRead] = 0.5;
+      workload.proportions[kUpdate] = 0.5;
+      break;
+    case 'b':
+      workload.proportions[kRead] = 0.95;
+      workload.proportions[kUpdate] = 0.05;
+      break;
+    case 'c':
+      workload.proportions[kRead] = 1.0;
+      break;
+    case 'd':
+      workload.proportions[kRead] = 0.95;
+      workload.proportions[kInsert] = 0.05;
+      workload.latest = true;
+      break;
+    case 'e':
+      workload.proportions[kScan] = 0.95;
+      workload.proportions[kInsert] = 0.05;
+      break;
+    case 'f':
+      workload.proportions[kRead] = 0.5;
+      workload.proportions[kReadModifyWrite] = 0.5;
+      break;
+    default:
+      return false;
+  }
+  g_options.workload = w;
+  g_workload = workload;
+  return true;
+}
+
+void usage()
+{
+  printf("Usage: ycsb [-w a-f] [-u] [-n records] [-v value_bytes] [-c connections]\n"
+         "            [-t threads] [-q depth] [-D seconds] [-l] [-b batch] server[:port] ...\n"
+         "  -u  uniform instead of zipfian keys\n"
+         "  -q  operations in flight per connection, default 1\n"
+         "  -l  load the records before running\n"
+         "  a server starting with '/' is the shm path of a server on this host\n");
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+  setWorkload('a');
+  g_options.uniform = false;
+  g_options.records = 100000;
+  g_options.valueSize = 1000;
+  g_options.connections = 16;
+  g_options.threads = 1;
+  g_options.depth = 1;
+  g_options.duration = 10;
+  g_options.load = false;
+  g_options.batch = 100;
+  // a server going away fails its calls, instead of killing us
+  signal(SIGPIPE, SIG_IGN);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "w:un:v:c:t:q:D:lb:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'w':
+        if (!setWorkload(optarg[0]))
+        {
+          usage();
+          return 1;
+        }
+        break;
+      case 'u':
+        g_options.uniform = true;
+        break;
+      case 'n':
+        g_options.records = atoll(optarg);
+        break;
+      case 'v':
+        g_options.valueSize = atoi(optarg);
+        break;
+      case 'c':
+        g_options.connections = atoi(optarg);
+        break;
+      case 't':
+        g_options.threads = atoi(optarg);
+        break;
+      case 'q':
+        g_options.depth = atoi(optarg);
+        break;
+      case 'D':
+        g_options.duration = atoi(optarg);
+        break;
+      case 'l':
+        g_options.load = true;
+        break;
+      case 'b':
+        g_options.batch = atoi(optarg);
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+  for (int i = optind; i < argc; ++i)
+  {
+    g_options.servers.push_back(argv[i]);
+  }
+  if (g_options.servers.empty() || g_options.records < 1 || g_options.threads < 1
+      || g_options.connections < g_options.threads || g_options.depth < 1
+      || g_options.batch < 1)
+  {
+    usage();
+    return 1;
+  }
+
+  g_value.assign(g_options.valueSize, 'v');
+  g_inserted.reset(g_options.records);
+  Zipfian zipfian(g_options.records);
+  g_zipfian = &zipfian;
+  pthread_barrier_init(&g_loaded, NULL, g_options.threads + 1);
+
+  printf("workload %c %s records %lld value %d connections %d threads %d depth %d\n",
+         g_options.workload, g_options.uniform ? "uniform" : (g_workload.latest ? "latest" : "zipfian"),
+         static_cast<long long>(g_options.records), g_options.valueSize,
+         g_options.connections, g_options.threads, g_options.depth);
+
+  std::vector<ThreadData*> threads;
+  for (int i = 0; i < g_options.threads; ++i)
+  {
+    ThreadData* data = new ThreadData;
+    data->connections = g_options.connections / g_options.threads
+                        + (i < g_options.connections % g_options.threads ? 1 : 0);
+    data->loadBegin = g_options.load ? g_options.records * i / g_options.threads : 0;
+    data->loadEnd = g_options.load ? g_options.records * (i + 1) / g_options.threads : 0;
+    data->errors = 0;
+    data->failed = 0;
+    pthread_create(&data->thread, NULL, runThread, data);
+    threads.push_back(data);
+  }
+
+  int64_t loadStart = nowNanos();
+  pthread_barrier_wait(&g_loaded);
+  if (g_options.load)
+  {
+    double seconds = (nowNanos() - loadStart) / 1e9;
+    printf("loaded %lld records in %.2fs, %.0f records/s\n",
+           static_cast<long long>(g_options.records), seconds, g_options.records / seconds);
+  }
+
+  const int64_t start = nowNanos();
+  Histogram histograms[kNumOpTypes];
+  int64_t errors = 0;
+  int64_t failed = 0;
+  for (size_t i = 0; i < threads.size(); ++i)
+  {
+    pthread_join(threads[i]->thread, NULL);
+    for (int t = 0; t < kNumOpTypes; ++t)
+    {
+      histograms[t].merge(threads[i]->histograms[t]);
+    }
+    errors += threads[i]->errors;
+    failed += threads[i]->failed;
+    delete threads[i];
+  }
+  const double seconds = (nowNanos() - start) / 1e9;
+
+  int64_t ops = 0;
+  for (int t = 0; t < kNumOpTypes; ++t)
+  {
+    ops += histograms[t].count();
+  }
+  printf("%lld operations in %.2fs, %.0f ops/s, %lld not OK, %lld failed\n",
+         static_cast<long long>(ops), seconds, ops / seconds, static_cast<long long>(errors),
+         static_cast<long long>(failed));
+  for (int t = 0; t < kNumOpTypes; ++t)
+  {
+    if (histograms[t].count() > 0)
+    {
+      histograms[t].print(stdout, kOpNames[t]);
+    }
+  }
+  pthread_barrier_destroy(&g_loaded);
+}
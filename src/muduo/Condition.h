@@ -0,0 +1,58 @@
+// excerpts from http://code.google.com/p/muduo/
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+//
+// Author: Shuo Chen (giantchen at gmail dot com)
+
+#ifndef MUDUO_BASE_CONDITION_H
+#define MUDUO_BASE_CONDITION_H
+
+#include "Mutex.h"
+
+// #include <boost/noncopyable.hpp>
+#include <pthread.h>
+
+namespace muduo
+{
+
+class Condition // : boost::noncopyable
+{
+ public:
+  explicit Condition(MutexLock& mutex) : mutex_(mutex)
+  {
+    pthread_cond_init(&pcond_, NULL);
+  }
+
+  ~Condition()
+  {
+    pthread_cond_destroy(&pcond_);
+  }
+
+  void wait()
+  {
+    mutex_.beforeWait();
+    pthread_cond_wait(&pcond_, mutex_.getPthreadMutex());
+    mutex_.afterWait();
+  }
+
+  void notify()
+  {
+    pthread_cond_signal(&pcond_);
+  }
+
+  void notifyAll()
+  {
+    pthread_cond_broadcast(&pcond_);
+  }
+
+ private:
+  MutexLock& mutex_;
+  pthread_cond_t pcond_;
+
+  void operator=(const Condition&);
+  Condition(const Condition&);
+};
+
+}
+#endif  // MUDUO_BASE_CONDITION_H
@@ -12,6 +12,10 @@
 #include <assert.h>
 #include <pthread.h>
 
+#ifdef MUDUO_MUTEX_PROFILING
+#include "MutexProfile.h"
+#endif
+
 namespace muduo
 {
 
@@ -20,7 +24,24 @@ class MutexLock // : boost::noncopyable
  public:
   MutexLock()
     : holder_(0)
+#ifdef MUDUO_MUTEX_PROFILING
+      , profile_(detail::profileOf("unnamed")),
+      lockedAt_(0)
+#endif
+  {
+    pthread_mutex_init(&mutex_, NULL);
+  }
+
+  // name is where the contention counters go, a string literal,
+  // ignored unless built with MUDUO_MUTEX_PROFILING.
+  explicit MutexLock(const char* name)
+    : holder_(0)
+#ifdef MUDUO_MUTEX_PROFILING
+      , profile_(detail::profileOf(name)),
+      lockedAt_(0)
+#endif
   {
+    (void)name;
     pthread_mutex_init(&mutex_, NULL);
   }
 
@@ -42,6 +63,7 @@ class MutexLock // : boost::noncopyable
 
   // internal usage
 
+#ifndef MUDUO_MUTEX_PROFILING
   void lock()
   {
     pthread_mutex_lock(&mutex_);
@@ -53,6 +75,45 @@ class MutexLock // : boost::noncopyable
     // holder_ = 0;
     pthread_mutex_unlock(&mutex_);
   }
+#else
+  void lock()
+  {
+    if (pthread_mutex_trylock(&mutex_) != 0)
+    {
+      int64_t start = detail::nowNanos();
+      pthread_mutex_lock(&mutex_);
+      lockedAt_ = detail::nowNanos();
+      profile_->contended.increment();
+      profile_->waitNanos.add(lockedAt_ - start);
+    }
+    else
+    {
+      lockedAt_ = detail::nowNanos();
+    }
+    profile_->acquisitions.increment();
+  }
+
+  void unlock()
+  {
+    profile_->holdNanos.add(detail::nowNanos() - lockedAt_);
+    pthread_mutex_unlock(&mutex_);
+  }
+#endif
+
+  // Condition::wait() releases the mutex, time asleep is not held
+  void beforeWait()
+  {
+#ifdef MUDUO_MUTEX_PROFILING
+    profile_->holdNanos.add(detail::nowNanos() - lockedAt_);
+#endif
+  }
+
+  void afterWait()
+  {
+#ifdef MUDUO_MUTEX_PROFILING
+    lockedAt_ = detail::nowNanos();
+#endif
+  }
 
   pthread_mutex_t* getPthreadMutex() /* non-const */
   {
@@ -63,6 +124,10 @@ class MutexLock // : boost::noncopyable
 
   pthread_mutex_t mutex_;
   pid_t holder_;
+#ifdef MUDUO_MUTEX_PROFILING
+  detail::MutexProfile* profile_;
+  int64_t lockedAt_;  // guarded by mutex_
+#endif
 
   void operator=(const MutexLock&);
   MutexLock(const MutexLock&);
@@ -0,0 +1,138 @@
+// excerpts from http://code.google.com/p/muduo/
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the License file.
+//
+// Author: Shuo Chen (giantchen at gmail dot com)
+
+#ifndef MUDUO_BASE_MUTEXPROFILE_H
+#define MUDUO_BASE_MUTEXPROFILE_H
+
+#include "Atomic.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+// Lock contention counters, compiled in with -DMUDUO_MUTEX_PROFILING, which
+// src/flags.mk sets for the library and the programs alike.
+// Every MutexLock of the same name adds to one MutexProfile, which lives
+// until exit.
+
+namespace muduo
+{
+
+namespace detail
+{
+
+struct MutexProfile // : boost::noncopyable
+{
+  const char* name;
+  AtomicInt64 acquisitions;
+  AtomicInt64 contended;    // trylock failed, had to wait
+  AtomicInt64 waitNanos;
+  AtomicInt64 holdNanos;
+  MutexProfile* next;
+};
+
+inline int64_t nowNanos()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+inline pthread_mutex_t* profilesMutex()
+{
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  return &mutex;
+}
+
+inline MutexProfile*& profilesHead()
+{
+  static MutexProfile* head = NULL;
+  return head;
+}
+
+// name must outlive the process, a string literal
+inline MutexProfile* profileOf(const char* name)
+{
+  pthread_mutex_lock(profilesMutex());
+  MutexProfile* profile = profilesHead();
+  while (profile != NULL && strcmp(profile->name, name) != 0)
+  {
+    profile = profile->next;
+  }
+  if (profile == NULL)
+  {
+    profile = new MutexProfile;
+    profile->name = name;
+    profile->next = profilesHead();
+    profilesHead() = profile;
+  }
+  pthread_mutex_unlock(profilesMutex());
+  return profile;
+}
+
+}
+
+struct MutexStats
+{
+  const char* name;
+  int64_t acquisitions;
+  int64_t contended;
+  int64_t waitNanos;
+  int64_t holdNanos;
+
+  bool operator<(const MutexStats& rhs) const
+  {
+    return waitNanos > rhs.waitNanos;
+  }
+};
+
+// All named locks, the longest total wait first.
+inline std::vector<MutexStats> mutexStats()
+{
+  std::vector<MutexStats> result;
+  pthread_mutex_lock(detail::profilesMutex());
+  for (detail::MutexProfile* p = detail::profilesHead(); p != NULL; p = p->next)
+  {
+    MutexStats stats;
+    stats.name = p->name;
+    stats.acquisitions = p->acquisitions.get();
+    stats.contended = p->contended.get();
+    stats.waitNanos = p->waitNanos.get();
+    stats.holdNanos = p->holdNanos.get();
+    result.push_back(stats);
+  }
+  pthread_mutex_unlock(detail::profilesMutex());
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+// The top worst offenders, one per line.
+inline void printMutexStats(FILE* out, size_t top)
+{
+  std::vector<MutexStats> stats = mutexStats();
+  fprintf(out, "%-32s %12s %12s %7s %12s %12s\n",
+          "lock", "acquired", "contended", "%", "wait_us", "hold_us");
+  for (size_t i = 0; i < stats.size() && i < top; ++i)
+  {
+    const MutexStats& s = stats[i];
+    fprintf(out, "%-32s %12lld %12lld %6.2f%% %12lld %12lld\n",
+            s.name, static_cast<long long>(s.acquisitions),
+            static_cast<long long>(s.contended),
+            s.acquisitions > 0 ? 100.0 * s.contended / s.acquisitions : 0.0,
+            static_cast<long long>(s.waitNanos / 1000),
+            static_cast<long long>(s.holdNanos / 1000));
+  }
+}
+
+}
+
+#endif  // MUDUO_BASE_MUTEXPROFILE_H
@@ -0,0 +1,150 @@
+#ifndef EVPROTO2_TEST_HISTOGRAM_H
+#define EVPROTO2_TEST_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+namespace evproto
+{
+namespace test
+{
+
+inline int64_t nowNanos()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Latencies in nanoseconds, log-linear buckets: 64 linear sub-buckets per
+// power of two, so any percentile is within 1/64 of the recorded value.
+// Not thread safe, keep one per thread and merge().
+class Histogram
+{
+ public:
+  Histogram()
+    : counts_(kNumBuckets),
+      count_(0),
+      sum_(0),
+      max_(0)
+  {
+  }
+
+  void record(int64_t value)
+  {
+    if (value < 0)
+    {
+      value = 0;
+    }
+    ++counts_[bucketOf(value)];
+    ++count_;
+    sum_ += value;
+    if (value > max_)
+    {
+      max_ = value;
+    }
+  }
+
+  void merge(const Histogram& rhs)
+  {
+    for (int i = 0; i < kNumBuckets; ++i)
+    {
+      counts_[i] += rhs.counts_[i];
+    }
+    count_ += rhs.count_;
+    sum_ += rhs.sum_;
+    if (rhs.max_ > max_)
+    {
+      max_ = rhs.max_;
+    }
+  }
+
+  void reset()
+  {
+    counts_.assign(kNumBuckets, 0);
+    count_ = 0;
+    sum_ = 0;
+    max_ = 0;
+  }
+
+  int64_t count() const { return count_; }
+  int64_t max() const { return max_; }
+  double mean() const { return count_ > 0 ? static_cast<double>(sum_) / count_ : 0; }
+
+  // p in [0, 100]
+  int64_t percentile(double p) const
+  {
+    if (count_ == 0)
+    {
+      return 0;
+    }
+    int64_t rank = static_cast<int64_t>(p / 100 * count_ + 0.5);
+    if (rank < 1)
+    {
+      rank = 1;
+    }
+    int64_t seen = 0;
+    for (int i = 0; i < kNumBuckets; ++i)
+    {
+      seen += counts_[i];
+      if (seen >= rank)
+      {
+        int64_t upper = upperBound(i);
+        return upper < max_ ? upper : max_;
+      }
+    }
+    return max_;
+  }
+
+  // one line, in microseconds
+  void print(FILE* out, const char* name) const
+  {
+    fprintf(out, "%-8s count %lld mean %.1f p50 %.1f p90 %.1f p99 %.1f p999 %.1f max %.1f us\n",
+            name, static_cast<long long>(count_), mean() / 1000,
+            percentile(50) / 1000.0, percentile(90) / 1000.0,
+            percentile(99) / 1000.0, percentile(99.9) / 1000.0,
+            max_ / 1000.0);
+  }
+
+ private:
+  static const int kSubBits = 6;
+  static const int kSubBuckets = 1 << kSubBits;
+  static const int kNumBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+  static int bucketOf(int64_t value)
+  {
+    uint64_t v = static_cast<uint64_t>(value);
+    if (v < static_cast<uint64_t>(kSubBuckets))
+    {
+      return static_cast<int>(v);
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - kSubBits;
+    return (shift + 1) * kSubBuckets + static_cast<int>((v >> shift) & (kSubBuckets - 1));
+  }
+
+  static int64_t upperBound(int bucket)
+  {
+    if (bucket < kSubBuckets)
+    {
+      return bucket;
+    }
+    int shift = bucket / kSubBuckets - 1;
+    int64_t sub = bucket % kSubBuckets + kSubBuckets;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  std::vector<int64_t> counts_;
+  int64_t count_;
+  int64_t sum_;
+  int64_t max_;
+};
+
+}
+}
+
+#endif  // EVPROTO2_TEST_HISTOGRAM_H
@@ -0,0 +1,381 @@
+#include "../RpcChannel.h"
+#include "../EventLoop.h"
+#include "../RpcController.h"
+#include "echo.pb.h"
+#include "Histogram.h"
+
+#include <event2/event.h>
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+// Load generator for the echo server in server.cc.
+//
+// Closed loop (default): every connection keeps 'depth' requests in flight.
+// A stalled server also holds back the requests that would have been sent
+// meanwhile, so latency percentiles understate stalls (coordinated
+// omission); use the open loop for latency.
+// Open loop (-r rate): requests are scheduled at a fixed total rate whatever
+// the server does, and latency is measured from the scheduled time, so a
+// stalled server is charged for the requests it held back (coordinated
+// omission). At most 'depth' requests per connection are on the wire, the
+// rest wait in the client and their wait counts.
+// A failed call, eg. the server went away, is counted apart from requests,
+// and ends its connection, which does not reconnect.
+
+using evproto::test::Histogram;
+using evproto::test::nowNanos;
+
+struct Options
+{
+  std::string host;
+  int port;
+  int connections;
+  int threads;
+  int depth;
+  int minSize;
+  int maxSize;
+  double rate;      // total requests per second, 0 for closed loop
+  int duration;     // seconds
+  int warmup;       // seconds
+};
+
+static Options g_options;
+static std::string g_payload;
+
+class Connection;
+
+struct ThreadData
+{
+  pthread_t thread;
+  int connections;
+  int64_t start;    // end of warmup
+  Histogram latency;
+  Histogram service;
+  int64_t requests;
+  int64_t bytes;
+  int64_t failed;   // not in the histograms, nor in requests
+};
+
+class Connection // : boost::noncopyable
+{
+ public:
+  Connection(evproto::EventLoop* loop, ThreadData* data, double rate)
+    : loop_(loop),
+      data_(data),
+      channel_(loop, g_options.host, g_options.port),
+      stub_(&channel_),
+      interval_(rate > 0 ? static_cast<int64_t>(1e9 / rate) : 0),
+      nextIntended_(0),
+      inflight_(0),
+      timer_(NULL),
+      seed_(static_cast<unsigned>(reinterpret_cast<uintptr_t>(this)))
+  {
+  }
+
+  ~Connection()
+  {
+    if (timer_)
+    {
+      event_free(timer_);
+    }
+  }
+
+  void start()
+  {
+    if (interval_ > 0)
+    {
+      // spread connections over one interval
+      nextIntended_ = nowNanos() + rand_r(&seed_) % interval_;
+      timer_ = evtimer_new(loop_->eventBase(), &Connection::timerCallback, this);
+      schedule();
+    }
+    else
+    {
+      for (int i = 0; i < g_options.depth; ++i)
+      {
+        send(nowNanos());
+      }
+    }
+  }
+
+ private:
+  struct Call
+  {
+    int64_t intended;
+    int64_t sent;
+    int size;
+    evproto::RpcController controller;
+  };
+
+  static void timerCallback(evutil_socket_t, short, void* ptr)
+  {
+    static_cast<Connection*>(ptr)->onTimer();
+  }
+
+  void onTimer()
+  {
+    const int64_t now = nowNanos();
+    while (nextIntended_ <= now)
+    {
+      backlog_.push_back(nextIntended_);
+      nextIntended_ += interval_;
+    }
+    drain();
+    schedule();
+  }
+
+  void schedule()
+  {
+    int64_t wait = nextIntended_ - nowNanos();
+    if (wait < 0)
+    {
+      wait = 0;
+    }
+    struct timeval tv = { static_cast<time_t>(wait / 1000000000),
+                          static_cast<suseconds_t>(wait % 1000000000 / 1000) };
+    evtimer_add(timer_, &tv);
+  }
+
+  void drain()
+  {
+    size_t i = 0;
+    while (i < backlog_.size() && inflight_ < g_options.depth)
+    {
+      send(backlog_[i++]);
+    }
+    backlog_.erase(backlog_.begin(), backlog_.begin() + i);
+  }
+
+  void send(int64_t intended)
+  {
+    int size = g_options.minSize;
+    if (g_options.maxSize > g_options.minSize)
+    {
+      size += rand_r(&seed_) % (g_options.maxSize - g_options.minSize + 1);
+    }
+
+    echo::EchoRequest request;
+    request.set_payload(g_payload.data(), size);
+    Call* call = new Call;
+    call->intended = intended;
+    call->size = size;
+    echo::EchoResponse* response = new echo::EchoResponse;
+    ++inflight_;
+    call->sent = nowNanos();
+    stub_.Echo(&call->controller, &request, response,
+               ::google::protobuf::NewCallback(this, &Connection::onResponse, call));
+  }
+
+  void onResponse(Call* call)
+  {
+    const int64_t now = nowNanos();
+    --inflight_;
+    if (call->controller.Failed())
+    {
+      // the channel is gone, stop rather than send more into it
+      ++data_->failed;
+      delete call;
+      if (timer_)
+      {
+        evtimer_del(timer_);
+      }
+      return;
+    }
+    if (call->sent >= data_->start)
+    {
+      data_->latency.record(now - call->intended);
+      data_->service.record(now - call->sent);
+      ++data_->requests;
+      data_->bytes += call->size;
+    }
+    delete call;
+
+    if (interval_ > 0)
+    {
+      drain();
+    }
+    else
+    {
+      send(now);
+    }
+  }
+
+  evproto::EventLoop* loop_;
+  ThreadData* data_;
+  evproto::RpcChannel channel_;
+  echo::EchoService::Stub stub_;
+  const int64_t interval_;
+  int64_t nextIntended_;
+  int inflight_;
+  std::vector<int64_t> backlog_;  // intended times not sent yet
+  struct event* timer_;
+  unsigned seed_;
+};
+
+static void* runThread(void* ptr)
+{
+  ThreadData* data = static_cast<ThreadData*>(ptr);
+  evproto::EventLoop loop;
+  const double rate = g_options.rate / g_options.connections;
+
+  std::vector<Connection*> connections;
+  for (int i = 0; i < data->connections; ++i)
+  {
+    connections.push_back(new Connection(&loop, data, rate));
+  }
+  for (size_t i = 0; i < connections.size(); ++i)
+  {
+    connections[i]->start();
+  }
+
+  struct timeval tv = { g_options.warmup + g_options.duration, 0 };
+  event_base_loopexit(loop.eventBase(), &tv);
+  loop.loop();
+
+  for (size_t i = 0; i < connections.size(); ++i)
+  {
+    delete connections[i];
+  }
+  return NULL;
+}
+
+static bool parseSize(const char* arg)
+{
+  char* end = NULL;
+  g_options.minSize = static_cast<int>(strtol(arg, &end, 10));
+  g_options.maxSize = g_options.minSize;
+  if (*end == '-')
+  {
+    g_options.maxSize = static_cast<int>(strtol(end + 1, &end, 10));
+  }
+  return *end == '\0' && g_options.minSize >= 0 && g_options.maxSize >= g_options.minSize;
+}
+
+static void usage()
+{
+  printf("Usage: bench [-h host] [-p port] [-c connections] [-t threads]\n"
+         "             [-d depth] [-s size|min-max] [-r rate] [-D seconds] [-w seconds]\n"
+         "  -d  requests in flight per connection, default 1\n"
+         "  -s  payload bytes, or uniformly distributed in [min, max]\n"
+         "  -r  total requests per second, open loop; default closed loop\n");
+}
+
+int main(int argc, char* argv[])
+{
+  g_options.host = "127.0.0.1";
+  g_options.port = 8888;
+  g_options.connections = 1;
+  g_options.threads = 1;
+  g_options.depth = 1;
+  g_options.minSize = 16;
+  g_options.maxSize = 16;
+  g_options.rate = 0;
+  g_options.duration = 10;
+  g_options.warmup = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:c:t:d:s:r:D:w:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'h':
+        g_options.host = optarg;
+        break;
+      case 'p':
+        g_options.port = atoi(optarg);
+        break;
+      case 'c':
+        g_options.connections = atoi(optarg);
+        break;
+      case 't':
+        g_options.threads = atoi(optarg);
+        break;
+      case 'd':
+        g_options.depth = atoi(optarg);
+        break;
+      case 's':
+        if (!parseSize(optarg))
+        {
+          usage();
+          return 1;
+        }
+        break;
+      case 'r':
+        g_options.rate = atof(optarg);
+        break;
+      case 'D':
+        g_options.duration = atoi(optarg);
+        break;
+      case 'w':
+        g_options.warmup = atoi(optarg);
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+  if (g_options.threads < 1 || g_options.connections < g_options.threads
+      || g_options.depth < 1 || g_options.duration < 1)
+  {
+    usage();
+    return 1;
+  }
+
+  g_payload.assign(g_options.maxSize, 'x');
+  // a server going away fails its calls, instead of killing us
+  signal(SIGPIPE, SIG_IGN);
+  // epoll_wait() has millisecond timeouts, which would delay the open loop
+  // schedule by up to a few ms; ask libevent 2.1 for timerfd instead.
+  setenv("EVENT_PRECISE_TIMER", "1", 0);
+  printf("%s:%d connections %d threads %d depth %d size %d-%d %s %.0f/s duration %ds warmup %ds\n",
+         g_options.host.c_str(), g_options.port, g_options.connections, g_options.threads,
+         g_options.depth, g_options.minSize, g_options.maxSize,
+         g_options.rate > 0 ? "open loop" : "closed loop", g_options.rate,
+         g_options.duration, g_options.warmup);
+
+  const int64_t start = nowNanos() + static_cast<int64_t>(g_options.warmup) * 1000000000;
+  std::vector<ThreadData*> threads;
+  for (int i = 0; i < g_options.threads; ++i)
+  {
+    ThreadData* data = new ThreadData;
+    data->connections = g_options.connections / g_options.threads
+                        + (i < g_options.connections % g_options.threads ? 1 : 0);
+    data->start = start;
+    data->requests = 0;
+    data->bytes = 0;
+    data->failed = 0;
+    pthread_create(&data->thread, NULL, runThread, data);
+    threads.push_back(data);
+  }
+
+  Histogram latency;
+  Histogram service;
+  int64_t requests = 0;
+  int64_t bytes = 0;
+  int64_t failed = 0;
+  for (size_t i = 0; i < threads.size(); ++i)
+  {
+    pthread_join(threads[i]->thread, NULL);
+    latency.merge(threads[i]->latency);
+    service.merge(threads[i]->service);
+    requests += threads[i]->requests;
+    bytes += threads[i]->bytes;
+    failed += threads[i]->failed;
+    delete threads[i];
+  }
+
+  const double seconds = (nowNanos() - start) / 1e9;
+  printf("%lld requests in %.2fs, %.0f req/s, %.2f MiB/s payload, %lld failed\n",
+         static_cast<long long>(requests), seconds, requests / seconds,
+         bytes / seconds / (1024 * 1024), static_cast<long long>(failed));
+  latency.print(stdout, "latency");
+  service.print(stdout, "service");
+}
@@ -0,0 +1,59 @@
+#include "../RpcChannel.h"
+#include "../EventLoop.h"
+#include "../Coroutine.h"
+#include "echo.pb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+evproto::Task run(evproto::EventLoop* loop, echo::EchoService::Stub* stub, int n)
+{
+  typedef decltype(evproto::call(stub, &echo::EchoService::Stub::Echo,
+                                 echo::EchoRequest())) EchoCall;
+
+  // sequential, each call depends on the previous response
+  echo::EchoRequest request;
+  request.set_payload("Hello");
+  EchoCall hello = evproto::call(stub, &echo::EchoService::Stub::Echo, request);
+  echo::EchoResponse response = co_await hello;
+  if (hello.Failed())
+  {
+    printf("failed: %s\n", hello.ErrorText().c_str());
+    event_base_loopexit(loop->eventBase(), NULL);
+    co_return;
+  }
+  printf("response: %s\n", response.payload().c_str());
+
+  // fan-out, all calls in flight at once
+  std::vector<EchoCall> calls;
+  for (int i = 0; i < n; ++i)
+  {
+    char buf[32];
+    snprintf(buf, sizeof buf, "%s %d", response.payload().c_str(), i);
+    request.set_payload(buf);
+    calls.push_back(evproto::call(stub, &echo::EchoService::Stub::Echo, request));
+  }
+  std::vector<echo::EchoResponse> responses = co_await evproto::whenAll(&calls);
+  size_t failed = 0;
+  for (size_t i = 0; i < calls.size(); ++i)
+  {
+    failed += calls[i].Failed();
+  }
+  printf("%zu responses, %zu failed, last: %s\n", responses.size(), failed,
+         responses.empty() ? "" : responses.back().payload().c_str());
+
+  event_base_loopexit(loop->eventBase(), NULL);
+}
+
+int main(int argc, char* argv[])
+{
+  const char* host = argc > 1 ? argv[1] : "127.0.0.1";
+  int n = argc > 2 ? atoi(argv[2]) : 100;
+
+  evproto::EventLoop loop;
+  evproto::RpcChannel channel(&loop, host, 8888);
+  echo::EchoService::Stub remoteService(&channel);
+
+  run(&loop, &remoteService, n);
+  loop.loop();
+}
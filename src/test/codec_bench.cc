@@ -0,0 +1,397 @@
+#include "../RpcChannel.h"
+#include "../rpc.pb.h"
+#include "echo.pb.h"
+#include "Histogram.h"
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "../Codec-inl.h"
+
+// Microbenchmarks of the codec in Codec-inl.h and of RpcChannel dispatch,
+// no network, one JSON object per line:
+//   {"bench":"read","payload":4096,"layout":"chunk1460","ns_per_frame":..,"allocs_per_frame":..}
+// allocs counts operator new calls, not libevent's malloc().
+
+using evproto::test::nowNanos;
+
+static long g_allocs = 0;
+
+void* operator new(size_t size)
+{
+  ++g_allocs;
+  void* p = malloc(size ? size : 1);
+  if (p == NULL)
+  {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) throw()
+{
+  free(p);
+}
+
+void operator delete(void* p, size_t) throw()
+{
+  free(p);
+}
+
+namespace
+{
+
+int64_t g_minNanos = 200 * 1000 * 1000;
+
+class EchoServiceImpl : public echo::EchoService
+{
+ public:
+  virtual void Echo(::google::protobuf::RpcController* controller,
+                    const ::echo::EchoRequest* request,
+                    ::echo::EchoResponse* response,
+                    ::google::protobuf::Closure* done)
+  {
+    response->set_payload(request->payload());
+    done->Run();
+  }
+};
+
+void report(const char* bench, int payload, const char* layout,
+            int64_t frames, int64_t nanos, long allocs)
+{
+  printf("{\"bench\":\"%s\",\"payload\":%d,\"layout\":\"%s\",\"frames\":%lld,"
+         "\"ns_per_frame\":%.1f,\"allocs_per_frame\":%.2f}\n",
+         bench, payload, layout, static_cast<long long>(frames),
+         static_cast<double>(nanos) / frames, static_cast<double>(allocs) / frames);
+  fflush(stdout);
+}
+
+// Runs body() in batches until g_minNanos has passed, body returns frames done.
+template<typename BODY>
+void measure(const char* bench, int payload, const char* layout, BODY body)
+{
+  body();  // warm up
+  int64_t frames = 0;
+  long allocs = g_allocs;
+  const int64_t start = nowNanos();
+  int64_t elapsed = 0;
+  do
+  {
+    frames += body();
+    elapsed = nowNanos() - start;
+  } while (elapsed < g_minNanos);
+  report(bench, payload, layout, frames, elapsed, g_allocs - allocs);
+}
+
+// Same, for bodies with set up that is not to be measured, body(&nanos)
+// adds the time of the part measured to nanos.
+template<typename BODY>
+void measureTimed(const char* bench, int payload, const char* layout, BODY body)
+{
+  int64_t nanos = 0;
+  body(&nanos);  // warm up
+  nanos = 0;
+  int64_t frames = 0;
+  long allocs = g_allocs;
+  do
+  {
+    frames += body(&nanos);
+  } while (nanos < g_minNanos);
+  report(bench, payload, layout, frames, nanos, g_allocs - allocs);
+}
+
+evproto::RpcMessage requestMessage(int payload)
+{
+  echo::EchoRequest request;
+  request.set_payload(std::string(payload, 'x'));
+  evproto::RpcMessage message;
+  message.set_type(evproto::REQUEST);
+  message.set_id(1);
+  message.set_service(echo::EchoService::descriptor()->name());
+  message.set_method("Echo");
+  message.set_request(request.SerializeAsString());
+  return message;
+}
+
+// a bufferevent without a socket, whose output the caller drains
+struct bufferevent* sink(struct event_base* base)
+{
+  struct bufferevent* bev = bufferevent_socket_new(base, -1, 0);
+  // the front of a bufferevent's output belongs to its writer, thaw it
+  evbuffer_unfreeze(bufferevent_get_output(bev), 1);
+  return bev;
+}
+
+// one complete frame, as send() puts it on the wire
+std::string encode(struct event_base* base, const evproto::RpcMessage& message)
+{
+  struct bufferevent* bev = sink(base);
+  evproto::send(bev, message);
+  struct evbuffer* output = bufferevent_get_output(bev);
+  std::string frame(evbuffer_get_length(output), '\0');
+  evbuffer_remove(output, &frame[0], frame.size());
+  bufferevent_free(bev);
+  return frame;
+}
+
+struct SendBody
+{
+  struct bufferevent* bev;
+  const evproto::RpcMessage* message;
+
+  int64_t operator()()
+  {
+    const int kFrames = 64;
+    struct evbuffer* output = bufferevent_get_output(bev);
+    for (int i = 0; i < kFrames; ++i)
+    {
+      evproto::send(bev, *message);
+      evbuffer_drain(output, evbuffer_get_length(output));
+    }
+    return kFrames;
+  }
+};
+
+struct ParseBody
+{
+  const std::string* frame;
+
+  int64_t operator()()
+  {
+    const int kFrames = 64;
+    const int len = static_cast<int>(frame->size()) - 4;
+    for (int i = 0; i < kFrames; ++i)
+    {
+      evproto::RpcMessage message;
+      evproto::ParseErrorCode error = evproto::parse(frame->data() + 4, len, &message);
+      assert(error == evproto::kNoError);
+      (void)error;
+    }
+    return kFrames;
+  }
+};
+
+// Fills an evbuffer with frames, by reference in chunk sized chains,
+// then read() and dispatch them all to a channel. Only read() is timed.
+struct ReadBody
+{
+  const std::string* frames;   // several frames back to back
+  int numFrames;
+  size_t chunk;                // 0 for a single chain
+  evproto::RpcChannel* channel;
+
+  int64_t operator()(int64_t* nanos)
+  {
+    struct evbuffer* input = evbuffer_new();
+    const size_t n = chunk > 0 ? chunk : frames->size();
+    for (size_t off = 0; off < frames->size(); off += n)
+    {
+      size_t len = std::min(n, frames->size() - off);
+      if (chunk > 0)
+      {
+        evbuffer_add_reference(input, frames->data() + off, len, NULL, NULL);
+      }
+      else
+      {
+        evbuffer_add(input, frames->data() + off, len);
+      }
+    }
+    const int64_t start = nowNanos();
+    evproto::ParseErrorCode error = evproto::read(input, channel);
+    *nanos += nowNanos() - start;
+    assert(error == evproto::kNoError && evbuffer_get_length(input) == 0);
+    (void)error;
+    evbuffer_free(input);
+    return numFrames;
+  }
+};
+
+void noop()
+{
+}
+
+// CallMethod() a batch, then a response to each through onMessage(), with
+// the id decoded from its request as the peer would.
+struct CallBody
+{
+  evproto::RpcChannel* channel;
+  const ::google::protobuf::MethodDescriptor* method;
+  const echo::EchoRequest* request;
+  evproto::RpcMessage* response;
+  evproto::RpcMessage* sent;   // reused, so that decoding does not allocate
+  std::string* wire;
+  struct event_base* base;
+  int peer;
+
+  int64_t operator()()
+  {
+    const int kFrames = 64;
+    for (int i = 0; i < kFrames; ++i)
+    {
+      channel->CallMethod(method, NULL, request, new echo::EchoResponse,
+                          ::google::protobuf::NewCallback(&noop));
+    }
+    wire->clear();
+    flush(base, peer, wire);
+    size_t off = 0;
+    while (off + 4 <= wire->size())
+    {
+      int32_t be32 = 0;
+      memcpy(&be32, wire->data() + off, sizeof be32);
+      const int len = ntohl(be32);
+      evproto::ParseErrorCode error = evproto::parse(wire->data() + off + 4, len, sent);
+      assert(error == evproto::kNoError);
+      (void)error;
+      response->set_id(sent->id());
+      channel->onMessage(*response);
+      off += 4 + len;
+    }
+    assert(off == wire->size());
+    return kFrames;
+  }
+
+  // writes out what the channel sent, the peer keeps it in out, if any
+  static void flush(struct event_base* base, int peer, std::string* out = NULL)
+  {
+    char buf[65536];
+    ssize_t n = 0;
+    do
+    {
+      event_base_loop(base, EVLOOP_NONBLOCK);
+      n = 0;
+      ssize_t nr = 0;
+      while ((nr = ::read(peer, buf, sizeof buf)) > 0)
+      {
+        n += nr;
+        if (out)
+        {
+          out->append(buf, nr);
+        }
+      }
+    } while (n > 0);
+  }
+};
+
+// server side: REQUEST through onMessage(), the service, and the response send().
+struct DispatchBody
+{
+  evproto::RpcChannel* channel;
+  const evproto::RpcMessage* request;
+  struct event_base* base;
+  int peer;
+
+  int64_t operator()()
+  {
+    const int kFrames = 64;
+    for (int i = 0; i < kFrames; ++i)
+    {
+      channel->onMessage(*request);
+    }
+    CallBody::flush(base, peer);
+    return kFrames;
+  }
+};
+
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc > 1)
+  {
+    g_minNanos = static_cast<int64_t>(atoi(argv[1])) * 1000 * 1000;
+  }
+
+  struct event_base* base = event_base_new();
+  EchoServiceImpl impl;
+  std::map<std::string, ::google::protobuf::Service*> services;
+  services[impl.GetDescriptor()->name()] = &impl;
+
+  const int payloads[] = { 16, 256, 4096, 65536, 1024 * 1024 };
+  const size_t chunks[] = { 0, 4096, 1460, 64 };
+  const char* layouts[] = { "contiguous", "chunk4096", "chunk1460", "chunk64" };
+
+  for (size_t p = 0; p < sizeof payloads / sizeof payloads[0]; ++p)
+  {
+    const int payload = payloads[p];
+    const evproto::RpcMessage message = requestMessage(payload);
+    const std::string frame = encode(base, message);
+
+    {
+      struct bufferevent* bev = sink(base);
+      SendBody body = { bev, &message };
+      measure("send", payload, "-", body);
+      bufferevent_free(bev);
+    }
+
+    {
+      ParseBody body = { &frame };
+      measure("parse", payload, "-", body);
+    }
+
+    for (size_t c = 0; c < sizeof chunks / sizeof chunks[0]; ++c)
+    {
+      // a client channel drops responses to unknown ids, so read() is
+      // measured with the least dispatch work
+      int fds[2];
+      socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+      evproto::RpcChannel channel(base, fds[0], services);
+
+      evproto::RpcMessage response;
+      response.set_type(evproto::RESPONSE);
+      response.set_id(0);
+      response.set_response(message.request());
+      const std::string one = encode(base, response);
+      const int numFrames = std::max(1, (256 * 1024) / static_cast<int>(one.size()));
+      std::string frames;
+      for (int i = 0; i < numFrames; ++i)
+      {
+        frames += one;
+      }
+
+      ReadBody body = { &frames, numFrames, chunks[c], &channel };
+      measureTimed("read", payload, layouts[c], body);
+      close(fds[1]);
+    }
+
+    {
+      int fds[2];
+      socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+      fcntl(fds[1], F_SETFL, O_NONBLOCK);
+      evproto::RpcChannel channel(base, fds[0], services);
+
+      echo::EchoRequest request;
+      request.set_payload(std::string(payload, 'x'));
+      echo::EchoResponse echoed;
+      echoed.set_payload(request.payload());
+      evproto::RpcMessage response;
+      response.set_type(evproto::RESPONSE);
+      response.set_response(echoed.SerializeAsString());
+      evproto::RpcMessage sent;
+      std::string wire;
+      CallBody call = { &channel, echo::EchoService::descriptor()->FindMethodByName("Echo"),
+                        &request, &response, &sent, &wire, base, fds[1] };
+      measure("call", payload, "-", call);
+
+      DispatchBody dispatch = { &channel, &message, base, fds[1] };
+      measure("dispatch", payload, "-", dispatch);
+      close(fds[1]);
+    }
+  }
+
+  event_base_free(base);
+}
@@ -32,6 +32,12 @@ int main(int argc, char* argv[])
     server.setThreadNum(numThreads);
   }
 
+  if (argc > 2)
+  {
+    // same host clients connect to this path instead of the port
+    server.listenShm(argv[2]);
+  }
+
   echo::EchoServiceImpl impl;
   server.registerService(&impl);
 